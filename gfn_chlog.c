@@ -0,0 +1,203 @@
+// gfn_chlog.c
+#include <linux/kvm_host.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "gfn_chlog.h"
+#include "gfn_vm.h"
+
+/* Changed HVA ranges kept per VM before the oldest are overwritten. */
+#define GFN_CHLOG_SIZE 4096
+
+struct gfn_chlog_ent {
+  u64 gen;
+  unsigned long start, end; /* HVA range */
+};
+
+/*
+ * Ring of HVA ranges the VM's mmu_notifier has invalidated, each stamped
+ * with the generation it was logged at. Ranges are kept by HVA because
+ * that is how invalidations arrive, and turned into GFNs at query time.
+ * Every change after floor is in the ring; a query from before it has
+ * lost changes and must take a full snapshot instead.
+ */
+struct gfn_chlog {
+  spinlock_t lock;
+  u64 gen;       /* generation of the newest change */
+  u64 floor;     /* no change after this generation was dropped */
+  u64 slots_gen; /* memslot generation the ring is valid for */
+  unsigned int head, nr;
+  struct gfn_chlog_ent ent[GFN_CHLOG_SIZE];
+};
+
+static struct gfn_chlog_ent *gfn_chlog_at(struct gfn_chlog *log,
+                                          unsigned int i) {
+  return &log->ent[(log->head + i) % GFN_CHLOG_SIZE];
+}
+
+/*
+ * From the mmu_notifier: record that [start, end) changed. A range that
+ * touches the newest entry is folded into it, so a burst over one area
+ * (a THP split, a migration batch) takes a single slot. Nothing is kept
+ * until the first query creates the log.
+ */
+void gfn_chlog_note(struct gfn_vm *vm, unsigned long start,
+                    unsigned long end) {
+  struct gfn_chlog *log = smp_load_acquire(&vm->chlog);
+  struct gfn_chlog_ent *last;
+
+  if (!log)
+    return;
+
+  spin_lock(&log->lock);
+  log->gen++;
+  if (log->nr) {
+    last = gfn_chlog_at(log, log->nr - 1);
+    if (start <= last->end && end >= last->start) {
+      last->start = min(last->start, start);
+      last->end = max(last->end, end);
+      last->gen = log->gen;
+      goto out;
+    }
+  }
+  if (log->nr == GFN_CHLOG_SIZE) {
+    log->floor = gfn_chlog_at(log, 0)->gen;
+    log->head = (log->head + 1) % GFN_CHLOG_SIZE;
+    log->nr--;
+  }
+  *gfn_chlog_at(log, log->nr++) = (struct gfn_chlog_ent){
+      .gen = log->gen,
+      .start = start,
+      .end = end,
+  };
+out:
+  spin_unlock(&log->lock);
+}
+
+static struct gfn_chlog *gfn_chlog_get(struct gfn_vm *vm) {
+  struct gfn_chlog *log = smp_load_acquire(&vm->chlog), *old;
+
+  if (log)
+    return log;
+
+  log = kvzalloc(sizeof(*log), GFP_KERNEL);
+  if (!log)
+    return NULL;
+  spin_lock_init(&log->lock);
+  log->gen = 1;
+  log->floor = 1;
+  log->slots_gen = U64_MAX;
+
+  old = cmpxchg_release(&vm->chlog, NULL, log);
+  if (old) {
+    kvfree(log);
+    return old;
+  }
+  return log;
+}
+
+/*
+ * Append the GFN ranges that the HVA range of e maps to, through every
+ * memslot it overlaps. Returns false, having written nothing, if they do
+ * not all fit. kvm->srcu held.
+ */
+static bool gfn_chlog_emit(struct kvm *kvm, const struct gfn_chlog_ent *e,
+                           struct gfn_change *out, u32 *n, u32 cap) {
+  struct kvm_memory_slot *slot;
+  u32 start = *n;
+  int bkt;
+
+  kvm_for_each_memslot(slot, bkt, kvm_memslots(kvm)) {
+    unsigned long hva = slot->userspace_addr;
+    unsigned long s = max(e->start, hva);
+    unsigned long end = min(e->end, hva + (slot->npages << PAGE_SHIFT));
+    gfn_t gfn;
+
+    if (s >= end)
+      continue;
+    if (*n == cap) {
+      *n = start;
+      return false;
+    }
+    gfn = slot->base_gfn + ((s - hva) >> PAGE_SHIFT);
+    out[(*n)++] = (struct gfn_change){
+        .gpa = (u64)gfn << PAGE_SHIFT,
+        .npages = DIV_ROUND_UP(end - s, PAGE_SIZE),
+    };
+  }
+  return true;
+}
+
+/*
+ * Fill out with the GFN ranges changed after q->since_gen and set q->gen
+ * to the generation to ask from next time. If out fills up first, q->gen
+ * stops at the last change reported and GFN_CHANGES_MORE is set. With
+ * GFN_CHANGES_OVERFLOW nothing is reported: the changes since then are not
+ * all known (the log was just created, wrapped, or the memslots changed)
+ * and the caller has to take a full snapshot.
+ */
+int gfn_chlog_query(struct gfn_vm *vm, struct kvm *kvm,
+                    struct gfn_change_query *q, struct gfn_change *out) {
+  struct gfn_chlog_ent *snap;
+  struct gfn_chlog *log;
+  unsigned int i, nr = 0;
+  u64 slots_gen, gen;
+  bool lost;
+  int idx;
+
+  log = gfn_chlog_get(vm);
+  snap = kvmalloc_array(GFN_CHLOG_SIZE, sizeof(*snap), GFP_KERNEL);
+  if (!log || !snap) {
+    kvfree(snap);
+    return -ENOMEM;
+  }
+
+  q->count = 0;
+  q->flags = 0;
+
+  idx = srcu_read_lock(&kvm->srcu);
+  slots_gen = kvm_memslots(kvm)->generation;
+
+  spin_lock(&log->lock);
+  if (log->slots_gen != slots_gen) {
+    /* The HVA to GFN layout moved; nothing logged before still applies. */
+    log->gen++;
+    log->floor = log->gen;
+    log->nr = 0;
+    log->slots_gen = slots_gen;
+  }
+  gen = log->gen;
+  lost = q->since_gen < log->floor;
+  for (i = 0; !lost && i < log->nr; i++) {
+    const struct gfn_chlog_ent *e = gfn_chlog_at(log, i);
+
+    if (e->gen > q->since_gen)
+      snap[nr++] = *e;
+  }
+  spin_unlock(&log->lock);
+
+  if (lost) {
+    q->flags = GFN_CHANGES_OVERFLOW;
+    q->gen = gen;
+    goto out;
+  }
+
+  q->gen = gen;
+  for (i = 0; i < nr; i++) {
+    if (!gfn_chlog_emit(kvm, &snap[i], out, &q->count, q->max_ranges)) {
+      q->gen = i ? snap[i - 1].gen : q->since_gen;
+      q->flags = GFN_CHANGES_MORE;
+      break;
+    }
+  }
+out:
+  srcu_read_unlock(&kvm->srcu, idx);
+  kvfree(snap);
+  if ((q->flags & GFN_CHANGES_MORE) && !q->count)
+    return -ENOSPC;
+  return 0;
+}
+
+void gfn_chlog_free(struct gfn_chlog *log) {
+  kvfree(log);
+}
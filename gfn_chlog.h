@@ -0,0 +1,17 @@
+#ifndef GFN_CHLOG_H
+#define GFN_CHLOG_H
+
+#include <linux/kvm_host.h>
+
+#include "gfn_ioctl.h"
+
+struct gfn_chlog;
+struct gfn_vm;
+
+void gfn_chlog_note(struct gfn_vm *vm, unsigned long start,
+                    unsigned long end);
+int gfn_chlog_query(struct gfn_vm *vm, struct kvm *kvm,
+                    struct gfn_change_query *q, struct gfn_change *out);
+void gfn_chlog_free(struct gfn_chlog *log);
+
+#endif /* GFN_CHLOG_H */
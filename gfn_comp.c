@@ -0,0 +1,252 @@
+// gfn_comp.c
+#include <linux/kvm_host.h>
+#include <linux/mm.h>
+#include <linux/mmap_lock.h>
+#include <linux/nodemask.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "gfn_comp.h"
+#include "gfn_vm.h"
+#include "gfn_xlate.h"
+
+#define COMP_PROC_NAME "gfn_to_pfn_composition"
+/* Guest pages walked per mmap lock hold: 16G. */
+#define COMP_WINDOW (16 * (PUD_SIZE >> PAGE_SHIFT))
+
+static struct proc_dir_entry *comp_proc;
+
+enum gfn_comp_bucket {
+  GFN_COMP_BASE,
+  GFN_COMP_THP_2M,
+  GFN_COMP_THP_1G,
+  GFN_COMP_HUGETLB_2M,
+  GFN_COMP_HUGETLB_1G,
+  GFN_COMP_NONE,
+  GFN_COMP_NR,
+};
+
+static const char *const gfn_comp_names[GFN_COMP_NR] = {
+    [GFN_COMP_BASE] = "base_4k",
+    [GFN_COMP_THP_2M] = "thp_2m",
+    [GFN_COMP_THP_1G] = "thp_1g",
+    [GFN_COMP_HUGETLB_2M] = "hugetlb_2m",
+    [GFN_COMP_HUGETLB_1G] = "hugetlb_1g",
+    [GFN_COMP_NONE] = "none",
+};
+
+/*
+ * Guest pages per bucket, and present pages per host node (nr_node_ids
+ * entries). Never fills, so a walk runs to its end.
+ */
+struct gfn_comp_sink {
+  struct gfn_sink sink;
+  u64 pages[GFN_COMP_NR];
+  u64 *nodes;
+};
+
+static enum gfn_comp_bucket gfn_comp_bucket(const struct gfn_run *run) {
+  bool big = run->map_size >= PUD_SIZE;
+
+  if (run->error)
+    return GFN_COMP_NONE;
+  if (run->map_size == PAGE_SIZE)
+    return GFN_COMP_BASE;
+  if (run->kind == GFN_KIND_HUGETLB)
+    return big ? GFN_COMP_HUGETLB_1G : GFN_COMP_HUGETLB_2M;
+  return big ? GFN_COMP_THP_1G : GFN_COMP_THP_2M;
+}
+
+static unsigned long gfn_comp_emit(struct gfn_sink *sink,
+                                   const struct gfn_run *run) {
+  struct gfn_comp_sink *cs = container_of(sink, struct gfn_comp_sink, sink);
+
+  cs->pages[gfn_comp_bucket(run)] += run->npages;
+  if (!run->error && run->node >= 0 && run->node < nr_node_ids)
+    cs->nodes[run->node] += run->npages;
+  return run->npages;
+}
+
+/* The memslot with the lowest base at or after gfn; kvm->srcu held. */
+static struct kvm_memory_slot *gfn_comp_next_slot(struct kvm *kvm, gfn_t gfn) {
+  struct kvm_memory_slot *slot, *next = NULL;
+  int bkt;
+
+  kvm_for_each_memslot(slot, bkt, kvm_memslots(kvm)) {
+    if (slot->base_gfn >= gfn && (!next || slot->base_gfn < next->base_gfn))
+      next = slot;
+  }
+  return next;
+}
+
+/*
+ * Tally [gfn, end) of one memslot. The walk does not fault and takes one
+ * step per mapping or empty table entry, so huge and unpopulated areas
+ * cost one PMD or PUD visit rather than 512 PTEs. kvm->srcu and the mmap
+ * lock are taken per COMP_WINDOW, so a big VM does not hold off memslot
+ * updates for the whole read; pages of a slot deleted meanwhile count as
+ * none.
+ */
+static int gfn_comp_slot(struct kvm *kvm, gfn_t gfn, gfn_t end,
+                         struct gfn_comp_sink *cs) {
+  int idx;
+
+  while (gfn < end) {
+    gfn_t stop = min_t(gfn_t, end, gfn + COMP_WINDOW);
+
+    idx = srcu_read_lock(&kvm->srcu);
+    mmap_read_lock(kvm->mm);
+    gfn = gfn_walk_range(kvm, gfn, stop, GFN_XLATE_NOFAULT, &cs->sink);
+    mmap_read_unlock(kvm->mm);
+    srcu_read_unlock(&kvm->srcu, idx);
+    if (fatal_signal_pending(current))
+      return -EINTR;
+  }
+  return 0;
+}
+
+static void gfn_comp_print(struct seq_file *m, pid_t pid, const char *slot,
+                           u64 gpa, u64 npages,
+                           const struct gfn_comp_sink *cs) {
+  int i;
+
+  seq_printf(m, "pid=%d slot=%s gpa=0x%llx size_kB=%llu", pid, slot, gpa,
+             npages << (PAGE_SHIFT - 10));
+  for (i = 0; i < GFN_COMP_NR; i++)
+    seq_printf(m, " %s_kB=%llu", gfn_comp_names[i],
+               cs->pages[i] << (PAGE_SHIFT - 10));
+  for_each_node_state(i, N_MEMORY)
+    seq_printf(m, " node%d_kB=%llu", i, cs->nodes[i] << (PAGE_SHIFT - 10));
+  seq_putc(m, '\n');
+}
+
+/* Memslots are visited in GPA order, looked up afresh for each one. */
+static int gfn_comp_vm(struct seq_file *m, struct gfn_vm *vm,
+                       struct kvm *kvm) {
+  struct gfn_comp_sink total = {}, cs = {.sink.emit = gfn_comp_emit};
+  struct kvm_memory_slot *slot;
+  gfn_t gfn = 0, base = 0, nr = 0;
+  u64 npages = 0;
+  char id[16];
+  int idx, i, rc = 0;
+
+  total.nodes = kcalloc(2 * nr_node_ids, sizeof(u64), GFP_KERNEL);
+  if (!total.nodes)
+    return -ENOMEM;
+  cs.nodes = total.nodes + nr_node_ids;
+
+  for (;;) {
+    idx = srcu_read_lock(&kvm->srcu);
+    slot = gfn_comp_next_slot(kvm, gfn);
+    if (slot) {
+      snprintf(id, sizeof(id), "%d", slot->id);
+      base = slot->base_gfn;
+      nr = slot->npages;
+    }
+    srcu_read_unlock(&kvm->srcu, idx);
+    if (!slot)
+      break;
+
+    memset(cs.pages, 0, sizeof(cs.pages));
+    memset(cs.nodes, 0, nr_node_ids * sizeof(u64));
+    rc = gfn_comp_slot(kvm, base, base + nr, &cs);
+    if (rc)
+      break;
+
+    gfn_comp_print(m, vm->pid, id, (u64)base << PAGE_SHIFT, nr, &cs);
+    for (i = 0; i < GFN_COMP_NR; i++)
+      total.pages[i] += cs.pages[i];
+    for (i = 0; i < nr_node_ids; i++)
+      total.nodes[i] += cs.nodes[i];
+    npages += nr;
+    gfn = base + nr;
+  }
+
+  if (!rc)
+    gfn_comp_print(m, vm->pid, "all", 0, npages, &total);
+  kfree(total.nodes);
+  return rc;
+}
+
+/*
+ * The file is iterated one VM at a time, and *pos is the pid to resume
+ * from, so a read that stops mid-file or outgrows the buffer walks only
+ * the VM it stopped in again, not every VM before it.
+ */
+static void *gfn_comp_start(struct seq_file *m, loff_t *pos) {
+  unsigned long pid = *pos ? *pos - 1 : 0;
+  struct gfn_vm *vm;
+
+  /* A read from the top covers VMs no request has named yet. */
+  if (!*pos)
+    gfn_vm_sync();
+  vm = gfn_vm_next(&pid);
+
+  if (vm)
+    *pos = pid;
+  return vm;
+}
+
+static void *gfn_comp_next(struct seq_file *m, void *v, loff_t *pos) {
+  struct gfn_vm *vm = v;
+  unsigned long pid = vm->pid;
+
+  gfn_vm_put(vm);
+  *pos = pid + 1;
+  vm = gfn_vm_next(&pid);
+  if (vm)
+    *pos = pid;
+  return vm;
+}
+
+static void gfn_comp_stop(struct seq_file *m, void *v) {
+  if (v)
+    gfn_vm_put(v);
+}
+
+/*
+ * One line per memslot of every VM, then a per-VM total. Sizes
+ * are in kB of guest memory; the page size buckets of a line add up to its
+ * size, and the node columns split its present part by host node. A VM
+ * that goes away mid-read is skipped.
+ */
+static int gfn_comp_show(struct seq_file *m, void *v) {
+  struct gfn_vm *vm = v;
+  struct kvm *kvm;
+  int rc = 0;
+
+  kvm = gfn_vm_pin(vm);
+  if (kvm) {
+    rc = gfn_comp_vm(m, vm, kvm);
+    gfn_vm_unpin(kvm);
+  }
+  return rc;
+}
+
+static const struct seq_operations gfn_comp_seq_ops = {
+    .start = gfn_comp_start,
+    .next = gfn_comp_next,
+    .stop = gfn_comp_stop,
+    .show = gfn_comp_show,
+};
+
+static int gfn_comp_open(struct inode *inode, struct file *file) {
+  return seq_open(file, &gfn_comp_seq_ops);
+}
+
+static const struct proc_ops gfn_comp_fops = {
+    .proc_open = gfn_comp_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = seq_release,
+};
+
+int gfn_comp_init(void) {
+  comp_proc = proc_create(COMP_PROC_NAME, 0400, NULL, &gfn_comp_fops);
+  return comp_proc ? 0 : -ENOMEM;
+}
+
+void gfn_comp_exit(void) {
+  proc_remove(comp_proc);
+}
@@ -0,0 +1,8 @@
+#ifndef GFN_COMP_H
+#define GFN_COMP_H
+
+/* /proc/gfn_to_pfn_composition: backing page sizes per VM and memslot. */
+int gfn_comp_init(void);
+void gfn_comp_exit(void);
+
+#endif /* GFN_COMP_H */
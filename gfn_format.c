@@ -0,0 +1,202 @@
+#include "gfn_format.h"
+#include "gfn_ioctl.h"
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#else
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+static size_t scnprintf(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/* The kernel's scnprintf(): bytes actually written, not needed. */
+static size_t scnprintf(char *buf, size_t size, const char *fmt, ...) {
+  va_list args;
+  int n;
+
+  if (!size)
+    return 0;
+  va_start(args, fmt);
+  n = vsnprintf(buf, size, fmt, args);
+  va_end(args);
+  if (n < 0)
+    return 0;
+  return (size_t)n < size ? (size_t)n : size - 1;
+}
+#endif
+
+typedef unsigned long long ull;
+
+static const char *const kind_names[] = {
+    [GFN_KIND_NONE] = "none",
+    [GFN_KIND_BASE] = "base",
+    [GFN_KIND_THP] = "thp",
+    [GFN_KIND_HUGETLB] = "hugetlb",
+};
+
+/* Error names for CSV and JSON. */
+static const char *const err_names[] = {
+    [GFN_RECORD_OK] = "",
+    [GFN_RECORD_ERR_INPUT] = "invalid_input",
+    [GFN_RECORD_ERR_NO_VM] = "no_vm",
+    [GFN_RECORD_ERR_NO_VMS] = "no_vms",
+    [GFN_RECORD_ERR_HVA] = "hva",
+    [GFN_RECORD_ERR_GUP] = "gup",
+};
+
+static const char *kind_name(const struct gfn_record *rec) {
+  return rec->kind <= GFN_KIND_HUGETLB ? kind_names[rec->kind] : "?";
+}
+
+static const char *err_name(const struct gfn_record *rec) {
+  return rec->err <= GFN_RECORD_ERR_GUP ? err_names[rec->err] : "?";
+}
+
+/* The original text replies, byte for byte. */
+static size_t format_text(char *buf, size_t cap, const struct gfn_record *rec,
+                          const char *zone) {
+  size_t n;
+
+  switch (rec->type) {
+  case GFN_RECORD_INVAL:
+    return scnprintf(buf, cap,
+                     "event:inval pid=%llu gpa=0x%llx npages=%llu "
+                     "cookie=%llu\n",
+                     (ull)rec->vm_pid, (ull)rec->gpa, (ull)rec->npages,
+                     (ull)rec->cookie);
+  case GFN_RECORD_OVERFLOW:
+    return scnprintf(buf, cap, "event:overflow lost=%llu\n",
+                     (ull)rec->cookie);
+  }
+
+  switch (rec->err) {
+  case GFN_RECORD_OK:
+    n = scnprintf(buf, cap,
+                  "ok phys=0x%llx kind=%s gpa=0x%llx hva=0x%llx node=%d "
+                  "zone=%s",
+                  (ull)rec->phys, kind_name(rec), (ull)rec->gpa,
+                  (ull)rec->hva, rec->node, zone);
+    break;
+  case GFN_RECORD_ERR_NO_VM:
+    n = scnprintf(buf, cap, "err:no_vm pid=%llu", (ull)rec->vm_pid);
+    break;
+  case GFN_RECORD_ERR_HVA:
+    n = scnprintf(buf, cap, "err:hva gfn=0x%llx", (ull)rec->gpa);
+    break;
+  case GFN_RECORD_ERR_GUP:
+    n = scnprintf(buf, cap, "err:gup=%d", rec->error);
+    break;
+  default:
+    n = scnprintf(buf, cap, "err:%s", err_name(rec));
+    break;
+  }
+  if (rec->flags & GFN_RECORD_HAS_TAG)
+    n += scnprintf(buf + n, cap - n, " tag=%llu", (ull)rec->tag);
+  n += scnprintf(buf + n, cap - n, "\n");
+  return n;
+}
+
+static const char *csv_type(const struct gfn_record *rec) {
+  switch (rec->type) {
+  case GFN_RECORD_INVAL:
+    return "inval";
+  case GFN_RECORD_OVERFLOW:
+    return "overflow";
+  default:
+    return rec->err ? "err" : "ok";
+  }
+}
+
+#define CSV_HEADER                                                             \
+  "type,pid,gpa,phys,hva,kind,node,zone,error,errno,tag,npages,cookie\n"
+
+/* Every column on every row; fields that do not apply are left empty. */
+static size_t format_csv(char *buf, size_t cap, const struct gfn_record *rec,
+                         const char *zone) {
+  size_t n;
+  int ok = rec->type == GFN_RECORD_RESULT && !rec->err;
+
+  n = scnprintf(buf, cap, "%s,%llu,%llu,", csv_type(rec), (ull)rec->vm_pid,
+                (ull)rec->gpa);
+  if (ok)
+    n += scnprintf(buf + n, cap - n, "%llu,%llu,%s,%d,%s,,,", (ull)rec->phys,
+                   (ull)rec->hva, kind_name(rec), rec->node, zone);
+  else if (rec->type == GFN_RECORD_RESULT)
+    n += scnprintf(buf + n, cap - n, ",,,,,%s,%d,", err_name(rec),
+                   rec->error);
+  else
+    n += scnprintf(buf + n, cap - n, ",,,,,,,");
+  if (rec->flags & GFN_RECORD_HAS_TAG)
+    n += scnprintf(buf + n, cap - n, "%llu", (ull)rec->tag);
+  if (rec->type == GFN_RECORD_RESULT)
+    n += scnprintf(buf + n, cap - n, ",,\n");
+  else
+    n += scnprintf(buf + n, cap - n, ",%llu,%llu\n", (ull)rec->npages,
+                   (ull)rec->cookie);
+  return n;
+}
+
+static size_t format_json(char *buf, size_t cap, const struct gfn_record *rec,
+                          const char *zone) {
+  size_t n;
+
+  switch (rec->type) {
+  case GFN_RECORD_INVAL:
+    return scnprintf(buf, cap,
+                     "{\"type\":\"inval\",\"pid\":%llu,\"gpa\":%llu,"
+                     "\"npages\":%llu,\"cookie\":%llu}\n",
+                     (ull)rec->vm_pid, (ull)rec->gpa, (ull)rec->npages,
+                     (ull)rec->cookie);
+  case GFN_RECORD_OVERFLOW:
+    return scnprintf(buf, cap, "{\"type\":\"overflow\",\"lost\":%llu}\n",
+                     (ull)rec->cookie);
+  }
+
+  n = scnprintf(buf, cap, "{\"type\":\"%s\",\"pid\":%llu,\"gpa\":%llu",
+                csv_type(rec), (ull)rec->vm_pid, (ull)rec->gpa);
+  if (!rec->err)
+    n += scnprintf(buf + n, cap - n,
+                   ",\"phys\":%llu,\"hva\":%llu,\"kind\":\"%s\","
+                   "\"node\":%d,\"zone\":\"%s\"",
+                   (ull)rec->phys, (ull)rec->hva, kind_name(rec), rec->node,
+                   zone);
+  else
+    n += scnprintf(buf + n, cap - n, ",\"error\":\"%s\",\"errno\":%d",
+                   err_name(rec), rec->error);
+  if (rec->flags & GFN_RECORD_HAS_TAG)
+    n += scnprintf(buf + n, cap - n, ",\"tag\":%llu", (ull)rec->tag);
+  n += scnprintf(buf + n, cap - n, "}\n");
+  return n;
+}
+
+/* Line that opens a stream in fmt, if it has one. */
+size_t gfn_format_header(char *buf, size_t cap, enum gfn_format fmt) {
+  if (fmt != GFN_FORMAT_CSV)
+    return 0;
+  return scnprintf(buf, cap, "%s", CSV_HEADER);
+}
+
+/*
+ * Render rec into buf (cap bytes) in fmt and return the length. zone is
+ * the name of rec->zone for the text forms; the binary form copies the
+ * record as is, or nothing if cap is too small.
+ */
+size_t gfn_format_record(char *buf, size_t cap, enum gfn_format fmt,
+                         const struct gfn_record *rec, const char *zone) {
+  switch (fmt) {
+  case GFN_FORMAT_BINARY:
+    if (cap < sizeof(*rec))
+      return 0;
+    memcpy(buf, rec, sizeof(*rec));
+    return sizeof(*rec);
+  case GFN_FORMAT_CSV:
+    return format_csv(buf, cap, rec, zone);
+  case GFN_FORMAT_JSON:
+    return format_json(buf, cap, rec, zone);
+  default:
+    return format_text(buf, cap, rec, zone);
+  }
+}
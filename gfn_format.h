@@ -0,0 +1,66 @@
+#ifndef GFN_FORMAT_H
+#define GFN_FORMAT_H
+
+#include <linux/types.h>
+#ifndef __KERNEL__
+#include <stddef.h>
+#endif
+
+/* Reply formats for /proc/gfn_to_pfn, chosen per fd with GFN_IOC_FORMAT. */
+enum gfn_format {
+  GFN_FORMAT_TEXT = 0, /* "ok phys=0x... kind=..." lines, the default */
+  GFN_FORMAT_BINARY,   /* one struct gfn_record per reply */
+  GFN_FORMAT_CSV,      /* a header row, then one row per reply */
+  GFN_FORMAT_JSON,     /* one JSON object per line */
+  GFN_FORMAT_NR,
+};
+
+#define GFN_RECORD_VERSION 1
+
+enum gfn_record_type {
+  GFN_RECORD_RESULT = 1,  /* a translation, or why it failed */
+  GFN_RECORD_INVAL,       /* watch event: npages from gpa may move */
+  GFN_RECORD_OVERFLOW,    /* watch events dropped; count in cookie */
+};
+
+/* Where a failed result stopped; error holds the errno. */
+enum gfn_record_err {
+  GFN_RECORD_OK = 0,
+  GFN_RECORD_ERR_INPUT,  /* malformed request line */
+  GFN_RECORD_ERR_NO_VM,  /* no VM with that pid */
+  GFN_RECORD_ERR_NO_VMS, /* no VM at all */
+  GFN_RECORD_ERR_HVA,    /* GFN outside every memslot */
+  GFN_RECORD_ERR_GUP,    /* the host page could not be resolved */
+};
+
+#define GFN_RECORD_HAS_TAG (1U << 0)
+
+/*
+ * Fixed-layout reply. Readers check version and skip size bytes per
+ * record, so fields can be appended without breaking them.
+ */
+struct gfn_record {
+  __u16 version; /* GFN_RECORD_VERSION */
+  __u16 size;    /* sizeof(struct gfn_record) */
+  __u16 type;    /* enum gfn_record_type */
+  __u16 err;     /* enum gfn_record_err */
+  __s32 error;
+  __u32 kind; /* enum gfn_page_kind */
+  __s32 node;
+  __u32 zone;
+  __u32 flags; /* GFN_RECORD_* */
+  __u32 reserved;
+  __u64 vm_pid;
+  __u64 gpa;
+  __u64 phys;
+  __u64 hva;
+  __u64 tag;
+  __u64 npages; /* GFN_RECORD_INVAL */
+  __u64 cookie; /* GFN_RECORD_INVAL cookie, GFN_RECORD_OVERFLOW count */
+};
+
+size_t gfn_format_header(char *buf, size_t cap, enum gfn_format fmt);
+size_t gfn_format_record(char *buf, size_t cap, enum gfn_format fmt,
+                         const struct gfn_record *rec, const char *zone);
+
+#endif /* GFN_FORMAT_H */
@@ -0,0 +1,163 @@
+// gfn_gpt.c
+#include <linux/highmem.h>
+#include <linux/kvm_host.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "gfn_gpt.h"
+#include "gfn_xlate.h"
+
+/* Guest table pages kept per walker; a 4K walk touches at most five. */
+#define GFN_GPT_CACHE 16
+#define GFN_GPT_ENTRIES (PAGE_SIZE / sizeof(u64))
+
+/* x86-64 guest paging-structure entry bits. */
+#define GPT_PRESENT (1ULL << 0)
+#define GPT_LEAF (1ULL << 7) /* PS: 1G at level 3, 2M at level 2 */
+#define GPT_ADDR_MASK 0x000ffffffffff000ULL
+
+struct gfn_gpt_page {
+  u64 gpa; /* guest physical address of the table, or U64_MAX */
+  u64 ent[GFN_GPT_ENTRIES];
+};
+
+/*
+ * Walker over one guest address space for the length of a request. Table
+ * pages are copied in on first use and reused by later addresses, so a
+ * batch or range under the same upper levels reads each of them once. The
+ * copies are a snapshot: a guest that edits its tables mid-request may be
+ * reported as it was when the page was first read.
+ */
+struct gfn_gpt {
+  u64 root;
+  unsigned int levels;
+  u32 flags;
+  unsigned int victim; /* next cache slot to replace */
+  struct gfn_gpt_page cache[GFN_GPT_CACHE];
+};
+
+struct gfn_gpt *gfn_gpt_create(u64 root, u32 flags) {
+  struct gfn_gpt *gpt = kvmalloc(sizeof(*gpt), GFP_KERNEL);
+  unsigned int i;
+
+  if (!gpt)
+    return NULL;
+  gpt->root = root & GPT_ADDR_MASK;
+  gpt->levels = flags & GFN_GVA_LA57 ? 5 : 4;
+  gpt->flags = flags;
+  gpt->victim = 0;
+  for (i = 0; i < GFN_GPT_CACHE; i++)
+    gpt->cache[i].gpa = U64_MAX;
+  return gpt;
+}
+
+void gfn_gpt_destroy(struct gfn_gpt *gpt) {
+  kvfree(gpt);
+}
+
+/*
+ * Copy in the guest table page at gpa through its memslot, like any other
+ * guest page. With GFN_XLATE_NOFAULT a table page the host has not
+ * populated is not faulted in, and the walk fails instead.
+ */
+static int gfn_gpt_fill(struct kvm *kvm, struct gfn_gpt_page *tp, u64 gpa,
+                        u32 flags) {
+  unsigned int gup_flags = FOLL_GET;
+  struct page *page;
+  unsigned long hva;
+  void *va;
+  long ret;
+
+  if (gfn_to_hva_safe(kvm, gpa, &hva))
+    return -EFAULT;
+  if (flags & GFN_XLATE_NOFAULT)
+    gup_flags |= FOLL_NOFAULT;
+
+  ret = get_user_pages_remote(kvm->mm, hva, 1, gup_flags, &page, NULL);
+  if (ret <= 0)
+    return ret ? ret : -EFAULT;
+
+  va = kmap_local_page(page);
+  memcpy(tp->ent, va, PAGE_SIZE);
+  kunmap_local(va);
+  put_page(page);
+  tp->gpa = gpa;
+  return 0;
+}
+
+static int gfn_gpt_entry(struct gfn_gpt *gpt, struct kvm *kvm, u64 table,
+                         unsigned int idx, u64 *ent) {
+  struct gfn_gpt_page *tp;
+  unsigned int i;
+  int rc;
+
+  for (i = 0; i < GFN_GPT_CACHE; i++) {
+    if (gpt->cache[i].gpa == table) {
+      *ent = gpt->cache[i].ent[idx];
+      return 0;
+    }
+  }
+
+  tp = &gpt->cache[gpt->victim];
+  gpt->victim = (gpt->victim + 1) % GFN_GPT_CACHE;
+  tp->gpa = U64_MAX;
+  rc = gfn_gpt_fill(kvm, tp, table, gpt->flags);
+  if (rc)
+    return rc;
+  *ent = tp->ent[idx];
+  return 0;
+}
+
+/*
+ * Guest physical address of gva, -ENXIO if the guest has not mapped it, or
+ * -EINVAL if it is not canonical for the paging mode: bits 63..47 (63..56
+ * with LA57) must all match, or the guest would fault before any walk.
+ */
+static int gfn_gpt_walk(struct gfn_gpt *gpt, struct kvm *kvm, u64 gva,
+                        u64 *gpa) {
+  unsigned int level, shift, bits = PAGE_SHIFT + 9 * gpt->levels;
+  u64 table = gpt->root, ent, size;
+  int rc;
+
+  if ((u64)((s64)(gva << (64 - bits)) >> (64 - bits)) != gva)
+    return -EINVAL;
+
+  for (level = gpt->levels; level; level--) {
+    shift = PAGE_SHIFT + 9 * (level - 1);
+    rc = gfn_gpt_entry(gpt, kvm, table,
+                       (gva >> shift) & (GFN_GPT_ENTRIES - 1), &ent);
+    if (rc)
+      return rc;
+    if (!(ent & GPT_PRESENT))
+      return -ENXIO;
+
+    if (level == 1 || ((level == 2 || level == 3) && (ent & GPT_LEAF))) {
+      size = 1ULL << shift;
+      *gpa = (ent & GPT_ADDR_MASK & ~(size - 1)) | (gva & (size - 1));
+      return 0;
+    }
+    table = ent & GPT_ADDR_MASK;
+  }
+  return -ENXIO;
+}
+
+/*
+ * Translate gva through the guest's tables to a GPA, then on to the host
+ * page like a batch entry. kvm->srcu and the mmap read lock held.
+ */
+void gfn_gpt_xlate(struct gfn_gpt *gpt, struct kvm *kvm, struct gfn_vm *vm,
+                   u64 gva, struct gfn_xlate_result *res) {
+  struct gfn_xlate_req req = {.flags = gpt->flags & GFN_XLATE_NOFAULT};
+  u64 gpa;
+  int rc;
+
+  rc = gfn_gpt_walk(gpt, kvm, gva, &gpa);
+  if (rc) {
+    memset(res, 0, sizeof(*res));
+    res->error = rc;
+    return;
+  }
+  req.gfn = gpa;
+  gfn_xlate_one(kvm, vm, &req, res);
+}
@@ -0,0 +1,16 @@
+#ifndef GFN_GPT_H
+#define GFN_GPT_H
+
+#include <linux/kvm_host.h>
+
+#include "gfn_ioctl.h"
+
+struct gfn_gpt;
+struct gfn_vm;
+
+struct gfn_gpt *gfn_gpt_create(u64 root, u32 flags);
+void gfn_gpt_xlate(struct gfn_gpt *gpt, struct kvm *kvm, struct gfn_vm *vm,
+                   u64 gva, struct gfn_xlate_result *res);
+void gfn_gpt_destroy(struct gfn_gpt *gpt);
+
+#endif /* GFN_GPT_H */
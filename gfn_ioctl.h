@@ -0,0 +1,386 @@
+#ifndef GFN_IOCTL_H
+#define GFN_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define GFN_IOC_MAGIC 0xF6
+
+/* Backing page classification reported in gfn_xlate_result.kind. */
+enum gfn_page_kind {
+  GFN_KIND_NONE = 0,
+  GFN_KIND_BASE,
+  GFN_KIND_THP,
+  GFN_KIND_HUGETLB,
+};
+
+/*
+ * Lookup mode. By default pages are resolved with get_user_pages_remote(),
+ * which faults in anything not yet populated. GFN_XLATE_NOFAULT walks the
+ * host page tables instead: nothing is pinned or faulted, unpopulated pages
+ * come back with kind GFN_KIND_NONE and error -ENOENT, and kind describes
+ * the size of the mapping (a PTE-mapped THP reports as base).
+ */
+#define GFN_XLATE_NOFAULT (1U << 0)
+
+/*
+ * One lookup. gfn uses the same encoding as the text interface: the guest
+ * frame address including the in-page offset (gfn << 12 | offset).
+ */
+struct gfn_xlate_req {
+  __u64 gfn;
+  __u32 flags; /* GFN_XLATE_* */
+  __u32 reserved;
+};
+
+/* gfn_xlate_result.node for pages the host has no struct page for. */
+#define GFN_NODE_NONE (-1)
+
+/*
+ * Fixed-size answer for one gfn_xlate_req; error is 0 or a negative errno.
+ * On success node is the host NUMA node of the backing page and zone its
+ * host zone index (enum zone_type, ZONE_NORMAL and so on).
+ */
+struct gfn_xlate_result {
+  __u64 gpa;
+  __u64 phys;
+  __u64 hva;
+  __u32 kind;
+  __s32 error;
+  __s32 node;
+  __u32 zone;
+};
+
+/*
+ * GFN_IOC_XLATE_BATCH: translate count requests against one VM. vm_pid 0
+ * selects the VM the fd is bound to, or else the first VM, like a text
+ * request without a pid.
+ */
+struct gfn_xlate_batch {
+  __u64 vm_pid;
+  __u64 reqs;    /* user pointer to struct gfn_xlate_req[count] */
+  __u64 results; /* user pointer to struct gfn_xlate_result[count] */
+  __u32 count;
+  __u32 flags;
+};
+
+/*
+ * GFN_IOC_XLATE_RANGE: translate npages contiguous guest pages starting at
+ * start_gfn (same encoding as gfn_xlate_req.gfn; the page offset is
+ * ignored). One result per page is written to results.
+ *
+ * When nr_nodes is set, node_pages[n] is also filled with the number of
+ * translated pages that sit on host node n, for n < nr_nodes.
+ */
+struct gfn_xlate_range {
+  __u64 vm_pid;
+  __u64 start_gfn;
+  __u64 npages;
+  __u64 results; /* user pointer to struct gfn_xlate_result[npages] */
+  __u32 flags;   /* GFN_XLATE_* */
+  __u32 nr_nodes;
+  __u64 node_pages; /* user pointer to __u64[nr_nodes] */
+};
+
+/*
+ * One run of guest memory: length bytes from gpa_start map to host
+ * physical memory starting at hpa_start. Physically contiguous pages and
+ * huge mappings collapse into one extent. Runs that failed to translate
+ * (no memslot, not present) are reported with error set and hpa_start 0.
+ */
+struct gfn_extent {
+  __u64 gpa_start;
+  __u64 hpa_start;
+  __u64 length;
+  __u32 kind;
+  __s32 error;
+};
+
+/*
+ * GFN_IOC_XLATE_EXTENTS: like GFN_IOC_XLATE_RANGE, but results come back as
+ * extents. count is set to the number written; if the buffer fills up
+ * before the span is covered, next_gfn is where to resume.
+ */
+struct gfn_xlate_extents {
+  __u64 vm_pid;
+  __u64 start_gfn;
+  __u64 npages;
+  __u64 extents; /* user pointer to struct gfn_extent[max_extents] */
+  __u32 max_extents;
+  __u32 flags;   /* GFN_XLATE_* */
+  __u32 count;   /* out */
+  __u32 reserved;
+  __u64 next_gfn; /* out */
+};
+
+/*
+ * Shared-memory rings. After GFN_IOC_RING_SETUP the submission ring is
+ * mapped at offset GFN_RING_OFF_SQ and the completion ring at
+ * GFN_RING_OFF_CQ. Each mapping starts with a gfn_ring_hdr followed by the
+ * entry array at GFN_RING_ENTRIES_OFF. head and tail are free-running;
+ * entry i lives at index i & mask. Userspace produces SQ entries and
+ * advances the SQ tail, then rings the doorbell with GFN_IOC_RING_ENTER;
+ * a kernel worker consumes them and posts one CQ entry each. Userspace
+ * advances the CQ head as it reaps. The worker stops when the CQ is full
+ * and picks up again at the next doorbell.
+ */
+struct gfn_ring_hdr {
+  __u32 head;
+  __u32 tail;
+  __u32 mask;
+  __u32 entries;
+};
+
+struct gfn_ring_sqe {
+  __u64 user_data;
+  __u64 gfn;
+  __u32 flags; /* GFN_XLATE_* */
+  __u32 reserved;
+};
+
+struct gfn_ring_cqe {
+  __u64 user_data;
+  struct gfn_xlate_result res;
+};
+
+/*
+ * Both entry counts must be powers of two. vm_pid 0 selects the bound VM,
+ * or else the first one. No flags are defined yet; flags and the reserved
+ * fields must be zero, so they can take new options later.
+ */
+struct gfn_ring_setup {
+  __u64 vm_pid;
+  __u32 sq_entries;
+  __u32 cq_entries;
+  __u32 flags;
+  __u32 reserved;
+  __u64 reserved2[4];
+};
+
+/*
+ * /proc/gfn_to_pfn_map/<pid>: a read-only "guest pagemap" of one VM. The
+ * file starts with a gfn_map_hdr, followed at hdr_size by nr_slots
+ * gfn_map_slot entries (address space 0). From data_off on, the record for
+ * guest page gfn is the __u64 at data_off + gfn * 8, so any GPA window can
+ * be fetched with one pread(). Records past end_gfn are not returned.
+ * Pages are looked up without faulting them in.
+ */
+#define GFN_MAP_MAGIC 0x50414d4e4647ULL /* "GFNMAP" */
+#define GFN_MAP_VERSION 1
+#define GFN_MAP_DATA_OFF (1ULL << 20)
+
+struct gfn_map_hdr {
+  __u64 magic;
+  __u32 version;
+  __u32 hdr_size;
+  __u32 slot_size;
+  __u32 nr_slots;
+  __u64 data_off;
+  __u64 end_gfn;
+  __u64 vm_pid;
+};
+
+struct gfn_map_slot {
+  __u64 base_gfn;
+  __u64 npages;
+  __u64 hva;
+  __u32 id;
+  __u32 flags; /* KVM_MEM_* */
+};
+
+/* Record bits; a gfn outside every memslot reads as 0. */
+#define GFN_MAP_PFN_MASK ((1ULL << 52) - 1)
+#define GFN_MAP_KIND_SHIFT 56
+#define GFN_MAP_KIND_MASK (0xFULL << GFN_MAP_KIND_SHIFT)
+#define GFN_MAP_SLOT (1ULL << 62)    /* covered by a memslot */
+#define GFN_MAP_PRESENT (1ULL << 63) /* mapped on the host; pfn is valid */
+
+/*
+ * Reverse lookup of one host PFN. Set pfn; on success vm_pid and gpa
+ * (page aligned) say where it is mapped, and error is 0. error is -ENOENT
+ * when no guest page maps it. A PFN mapped at several GFNs (the
+ * zero page, KSM) reports one of them.
+ */
+struct gfn_rmap_result {
+  __u64 pfn;
+  __u64 vm_pid;
+  __u64 gpa;
+  __u32 kind;
+  __s32 error;
+};
+
+/*
+ * GFN_IOC_RMAP_BATCH: attribute count PFNs. vm_pid 0 searches every VM
+ * on the host. Lookups use a per-VM PFN-sorted table that is rebuilt when
+ * the memslots or host mappings have changed since it was built.
+ */
+struct gfn_rmap_batch {
+  __u64 vm_pid;
+  __u64 results; /* user pointer to struct gfn_rmap_result[count] */
+  __u32 count;
+  __u32 flags;
+};
+
+/* Test-and-clear the accessed bits while sampling them. */
+#define GFN_ACCESS_CLEAR_YOUNG (1U << 0)
+
+/*
+ * GFN_IOC_ACCESS_BITS: sample npages guest pages from start_gfn in one
+ * page table walk, without faulting anything in. Bit i of the young
+ * bitmap is set if page start + i was accessed, combining the host PTE
+ * with KVM's own (EPT/NPT) accessed bits. Bit i of the dirty bitmap is set
+ * if the host PTE is dirty. Either pointer may be 0. Both bitmaps are
+ * arrays of DIV_ROUND_UP(npages, 64) __u64 words, with bit i at word
+ * i / 64, bit i % 64. With GFN_ACCESS_CLEAR_YOUNG the accessed bits are
+ * cleared as they are read, so successive calls give the working set
+ * since the previous one.
+ */
+struct gfn_access_bits {
+  __u64 vm_pid;
+  __u64 start_gfn; /* same encoding as gfn_xlate_req.gfn */
+  __u64 npages;
+  __u64 young; /* user pointer to the young bitmap, or 0 */
+  __u64 dirty; /* user pointer to the dirty bitmap, or 0 */
+  __u32 flags; /* GFN_ACCESS_* */
+  __u32 reserved;
+  __u64 nr_present; /* out: pages mapped on the host */
+  __u64 nr_young;   /* out */
+  __u64 nr_dirty;   /* out */
+};
+
+/*
+ * GFN_IOC_WATCH: report every host-side change to npages guest pages from
+ * start_gfn (same encoding as gfn_xlate_req.gfn) that can move their
+ * backing PFN: unmap, migration, compaction, THP split, swap-out. Each one
+ * queues a line on the fd, read and polled like a text reply, before the
+ * old PFN is released:
+ *
+ *     event:inval pid=<vm> gpa=0x<first page> npages=<n> cookie=<cookie>
+ *
+ * Translations in that span must be looked up again. When the VM exits,
+ * every watch fires once more. If events pile up unread, later ones are
+ * dropped and "event:overflow lost=<n>" is queued once there is room.
+ * GFN_IOC_UNWATCH takes a cookie and drops the watches added with it, or
+ * every watch on the fd for cookie 0.
+ */
+struct gfn_watch_req {
+  __u64 vm_pid;
+  __u64 start_gfn;
+  __u64 npages;
+  __u64 cookie; /* echoed in events */
+};
+
+/* One changed span of guest memory. */
+struct gfn_change {
+  __u64 gpa;
+  __u64 npages;
+};
+
+#define GFN_CHANGES_MORE (1U << 0)     /* out was full; ask again from gen */
+#define GFN_CHANGES_OVERFLOW (1U << 1) /* changes lost; take a full snapshot */
+
+/*
+ * GFN_IOC_CHANGES: guest ranges whose backing may have changed (any
+ * host-side invalidation: unmap, migration, THP split, swap-out) since
+ * generation since_gen. Start with since_gen 0, which reports
+ * GFN_CHANGES_OVERFLOW: take a full snapshot, then pass the returned gen
+ * next time to get only the churn. Ranges can overlap and cover more than
+ * what actually changed, never less.
+ */
+struct gfn_change_query {
+  __u64 vm_pid;
+  __u64 since_gen;
+  __u64 ranges; /* user pointer to struct gfn_change[max_ranges] */
+  __u32 max_ranges;
+  __u32 count; /* out */
+  __u64 gen;   /* out */
+  __u32 flags; /* out: GFN_CHANGES_* */
+  __u32 reserved;
+};
+
+/* GFN_IOC_GVA_XLATE flag: the guest uses 5-level paging (CR4.LA57). */
+#define GFN_GVA_LA57 (1U << 1)
+
+/*
+ * GFN_IOC_GVA_XLATE: translate guest virtual addresses straight to host
+ * pages by walking the guest's x86-64 page tables from root, its CR3
+ * value, with no helper inside the guest. Pass count addresses in gvas,
+ * or set gvas to 0 to translate count pages from start_gva. Each result
+ * is a batch result for the GPA the address maps to (gpa keeps the page
+ * offset). An address the guest has not mapped comes back with error
+ * -ENXIO and gpa 0, and a non-canonical one with -EINVAL; one whose
+ * tables lie outside every memslot gets -EFAULT. GFN_XLATE_NOFAULT applies
+ * to the table pages as well.
+ */
+struct gfn_gva_xlate {
+  __u64 vm_pid;
+  __u64 root;      /* guest CR3; PCID and flag bits are ignored */
+  __u64 gvas;      /* user pointer to __u64[count], or 0 */
+  __u64 start_gva; /* first address when gvas is 0 */
+  __u64 results;   /* user pointer to struct gfn_xlate_result[count] */
+  __u32 count;
+  __u32 flags; /* GFN_XLATE_NOFAULT, GFN_GVA_LA57 */
+};
+
+/*
+ * GFN_IOC_CONTIG: how fragmented npages guest pages from start_gfn are
+ * in host physical memory, for sizing DMA registrations. The range is
+ * cut into segments that are contiguous on both sides. The first
+ * max_segments of them are written to segments, where kind is the kind of
+ * a segment's first page. Pages with no host page end a segment and are
+ * counted in unbacked.
+ *
+ * score is 0 when the backed pages form one segment and 1000 when no two
+ * of them are adjacent: (nr_segments - 1) * 1000 / (backed pages - 1).
+ */
+struct gfn_contig_query {
+  __u64 vm_pid;
+  __u64 start_gfn;
+  __u64 npages;
+  __u64 segments; /* user pointer to struct gfn_extent[max_segments] */
+  __u32 max_segments;
+  __u32 flags;        /* GFN_XLATE_* */
+  __u64 nr_segments;  /* out: all segments, also those not written */
+  __u64 unbacked;     /* out: pages */
+  __u64 largest_gpa;  /* out */
+  __u64 largest_hpa;  /* out */
+  __u64 largest_len;  /* out: bytes */
+  __u32 score;        /* out */
+  __u32 reserved;
+};
+
+#define GFN_RING_OFF_SQ 0ULL
+#define GFN_RING_OFF_CQ 0x10000000ULL
+#define GFN_RING_ENTRIES_OFF 64
+#define GFN_RING_MAX_ENTRIES 65536
+
+#define GFN_XLATE_BATCH_MAX 65536
+#define GFN_XLATE_RANGE_MAX (1ULL << 28)
+
+#define GFN_IOC_XLATE_BATCH _IOW(GFN_IOC_MAGIC, 0x01, struct gfn_xlate_batch)
+#define GFN_IOC_XLATE_RANGE _IOW(GFN_IOC_MAGIC, 0x02, struct gfn_xlate_range)
+#define GFN_IOC_XLATE_EXTENTS                                                  \
+  _IOWR(GFN_IOC_MAGIC, 0x03, struct gfn_xlate_extents)
+#define GFN_IOC_RING_SETUP _IOW(GFN_IOC_MAGIC, 0x04, struct gfn_ring_setup)
+#define GFN_IOC_RING_ENTER _IO(GFN_IOC_MAGIC, 0x05)
+/*
+ * Bind the fd to the VM with this pid (0 unbinds). Requests on the fd that
+ * do not name a VM then target it without any lookup.
+ */
+#define GFN_IOC_BIND_VM _IOW(GFN_IOC_MAGIC, 0x06, __u64)
+#define GFN_IOC_RMAP_BATCH _IOW(GFN_IOC_MAGIC, 0x07, struct gfn_rmap_batch)
+#define GFN_IOC_ACCESS_BITS                                                    \
+  _IOWR(GFN_IOC_MAGIC, 0x08, struct gfn_access_bits)
+#define GFN_IOC_WATCH _IOW(GFN_IOC_MAGIC, 0x09, struct gfn_watch_req)
+#define GFN_IOC_UNWATCH _IOW(GFN_IOC_MAGIC, 0x0a, __u64)
+#define GFN_IOC_CHANGES                                                        \
+  _IOWR(GFN_IOC_MAGIC, 0x0b, struct gfn_change_query)
+/*
+ * Reply format for text requests and watch events read from the fd, an
+ * enum gfn_format from gfn_format.h. Replies already queued keep theirs.
+ */
+#define GFN_IOC_FORMAT _IOW(GFN_IOC_MAGIC, 0x0c, __u32)
+#define GFN_IOC_GVA_XLATE _IOW(GFN_IOC_MAGIC, 0x0d, struct gfn_gva_xlate)
+#define GFN_IOC_CONTIG _IOWR(GFN_IOC_MAGIC, 0x0e, struct gfn_contig_query)
+
+#endif /* GFN_IOCTL_H */
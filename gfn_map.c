@@ -0,0 +1,348 @@
+// gfn_map.c
+#include <linux/capability.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/kvm_host.h>
+#include <linux/mm.h>
+#include <linux/mmap_lock.h>
+#include <linux/proc_fs.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "gfn_map.h"
+#include "gfn_scan.h"
+#include "gfn_vm.h"
+#include "gfn_xlate.h"
+
+#define MAP_PROC_DIR "gfn_to_pfn_map"
+#define MEM_PROC_DIR "gfn_to_pfn_mem"
+#define MAP_RECORD_SIZE sizeof(u64)
+#define MAP_MAX_SLOTS                                                          \
+  ((GFN_MAP_DATA_OFF - sizeof(struct gfn_map_hdr)) /                          \
+   sizeof(struct gfn_map_slot))
+
+static struct proc_dir_entry *map_dir, *mem_dir;
+
+/* One past the highest gfn covered by a memslot; kvm->srcu held. */
+static gfn_t gfn_map_end(struct kvm *kvm) {
+  struct kvm_memory_slot *slot;
+  gfn_t end = 0;
+  int bkt;
+
+  kvm_for_each_memslot(slot, bkt, kvm_memslots(kvm))
+    end = max_t(gfn_t, end, slot->base_gfn + slot->npages);
+  return end;
+}
+
+/*
+ * Copy the part of the header region [pos, pos + count) that lies below
+ * GFN_MAP_DATA_OFF. The header and slot table are built fresh for every
+ * such read, sized to the current memslot count; the rest reads as zeros.
+ */
+static ssize_t gfn_map_read_hdr(struct gfn_vm *vm, struct kvm *kvm,
+                                char __user *ubuf, size_t count, loff_t pos) {
+  struct kvm_memory_slot *slot;
+  struct gfn_map_hdr *hdr;
+  struct gfn_map_slot *out;
+  size_t size, len, copied = 0;
+  u32 n = 0;
+  int bkt, idx;
+
+  count = min_t(u64, count, GFN_MAP_DATA_OFF - pos);
+
+  idx = srcu_read_lock(&kvm->srcu);
+  kvm_for_each_memslot(slot, bkt, kvm_memslots(kvm))
+    n++;
+  n = min_t(u32, n, MAP_MAX_SLOTS);
+
+  size = sizeof(*hdr) + n * sizeof(*out);
+  hdr = kvzalloc(size, GFP_KERNEL);
+  if (!hdr) {
+    srcu_read_unlock(&kvm->srcu, idx);
+    return -ENOMEM;
+  }
+
+  out = (struct gfn_map_slot *)(hdr + 1);
+  hdr->nr_slots = 0;
+  kvm_for_each_memslot(slot, bkt, kvm_memslots(kvm)) {
+    if (hdr->nr_slots == n)
+      break;
+    out->base_gfn = slot->base_gfn;
+    out->npages = slot->npages;
+    out->hva = slot->userspace_addr;
+    out->id = slot->id;
+    out->flags = slot->flags;
+    out++;
+    hdr->nr_slots++;
+  }
+  hdr->end_gfn = gfn_map_end(kvm);
+  srcu_read_unlock(&kvm->srcu, idx);
+
+  hdr->magic = GFN_MAP_MAGIC;
+  hdr->version = GFN_MAP_VERSION;
+  hdr->hdr_size = sizeof(*hdr);
+  hdr->slot_size = sizeof(*out);
+  hdr->data_off = GFN_MAP_DATA_OFF;
+  hdr->vm_pid = vm->pid;
+
+  if (pos < size) {
+    len = min_t(size_t, count, size - pos);
+    if (copy_to_user(ubuf, (char *)hdr + pos, len)) {
+      kvfree(hdr);
+      return -EFAULT;
+    }
+    copied = len;
+  }
+  kvfree(hdr);
+
+  if (copied < count && clear_user(ubuf + copied, count - copied))
+    return -EFAULT;
+  return count;
+}
+
+/*
+ * Records for the pages under [pos, pos + count), in GFN_MAP_STAGE
+ * batches. As with the range ioctl, each batch is filled by the scan
+ * workers and copied out before the next, so memory stays bounded for any
+ * guest size.
+ */
+static ssize_t gfn_map_read_records(struct kvm *kvm, char __user *ubuf,
+                                    size_t count, loff_t pos) {
+  u64 off = pos - GFN_MAP_DATA_OFF;
+  size_t skip = off % MAP_RECORD_SIZE, done = 0, len, n, cap;
+  gfn_t gfn = off / MAP_RECORD_SIZE, end;
+  u64 *stage;
+  int idx;
+
+  idx = srcu_read_lock(&kvm->srcu);
+  end = gfn_map_end(kvm);
+  srcu_read_unlock(&kvm->srcu, idx);
+
+  if (gfn >= end)
+    return 0;
+  end = min_t(gfn_t, end,
+              gfn + DIV_ROUND_UP(skip + count, MAP_RECORD_SIZE));
+
+  cap = min_t(gfn_t, end - gfn, GFN_MAP_STAGE);
+  stage = kvmalloc_array(cap, MAP_RECORD_SIZE, GFP_KERNEL);
+  if (!stage)
+    return -ENOMEM;
+
+  while (gfn < end && done < count) {
+    n = min_t(gfn_t, end - gfn, cap);
+    gfn_scan(kvm, gfn, gfn + n, GFN_XLATE_NOFAULT, GFN_SCAN_RECORDS, stage);
+    gfn += n;
+
+    len = min(n * MAP_RECORD_SIZE - skip, count - done);
+    if (copy_to_user(ubuf + done, (char *)stage + skip, len)) {
+      kvfree(stage);
+      return done ? done : -EFAULT;
+    }
+    done += len;
+    skip = 0;
+
+    if (fatal_signal_pending(current))
+      break;
+  }
+
+  kvfree(stage);
+  return done;
+}
+
+static ssize_t gfn_map_read(struct file *file, char __user *ubuf, size_t count,
+                            loff_t *ppos) {
+  struct gfn_vm *vm = file->private_data;
+  ssize_t ret = 0, done = 0;
+  loff_t pos = *ppos;
+  struct kvm *kvm;
+
+  if (pos < 0)
+    return -EINVAL;
+  if (!count)
+    return 0;
+
+  kvm = gfn_vm_pin(vm);
+  if (!kvm)
+    return -ESRCH;
+
+  if (pos < GFN_MAP_DATA_OFF) {
+    ret = gfn_map_read_hdr(vm, kvm, ubuf, count, pos);
+    if (ret > 0)
+      done = ret;
+  }
+  if (ret >= 0 && done < count) {
+    ret = gfn_map_read_records(kvm, ubuf + done, count - done, pos + done);
+    if (ret > 0)
+      done += ret;
+  }
+
+  gfn_vm_unpin(kvm);
+
+  if (!done)
+    return ret;
+  *ppos = pos + done;
+  return done;
+}
+
+/*
+ * Pin up to GFN_GUP_CHUNK guest pages from gpa, all in one memslot, under
+ * kvm->srcu and the mmap lock. Returns how many were pinned, or -EIO when
+ * gpa is outside every memslot.
+ */
+static long gfn_mem_pin(struct kvm *kvm, u64 gpa, size_t count,
+                        struct page **pages) {
+  struct kvm_memory_slot *slot;
+  gfn_t gfn = gpa >> PAGE_SHIFT;
+  unsigned long nr;
+  long got;
+  int idx;
+
+  nr = min_t(u64, GFN_GUP_CHUNK,
+             DIV_ROUND_UP((gpa & ~PAGE_MASK) + count, PAGE_SIZE));
+
+  idx = srcu_read_lock(&kvm->srcu);
+  slot = gfn_to_memslot(kvm, gfn);
+  if (!slot) {
+    srcu_read_unlock(&kvm->srcu, idx);
+    return -EIO;
+  }
+  nr = min_t(u64, nr, slot->base_gfn + slot->npages - gfn);
+
+  mmap_read_lock(kvm->mm);
+  got = get_user_pages_remote(kvm->mm, gfn_to_hva_memslot(slot, gfn), nr,
+                              FOLL_GET, pages, NULL);
+  mmap_read_unlock(kvm->mm);
+  srcu_read_unlock(&kvm->srcu, idx);
+  return got ? got : -EFAULT;
+}
+
+/*
+ * Guest memory at file offset = GPA. Pages are pinned a chunk at a time
+ * and copied out after the locks are dropped, so a fault on ubuf never
+ * nests inside the VM's mmap lock. A read stops short at the first GPA
+ * outside every memslot, and one that starts there fails with -EIO, as
+ * /proc/<pid>/mem does for unmapped addresses.
+ */
+static ssize_t gfn_mem_read(struct file *file, char __user *ubuf,
+                            size_t count, loff_t *ppos) {
+  struct page *pages[GFN_GUP_CHUNK];
+  struct gfn_vm *vm = file->private_data;
+  u64 gpa = *ppos;
+  size_t done = 0, len;
+  long got, i;
+  ssize_t rc = 0;
+  struct kvm *kvm;
+  void *va;
+
+  if (*ppos < 0)
+    return -EINVAL;
+
+  kvm = gfn_vm_pin(vm);
+  if (!kvm)
+    return -ESRCH;
+
+  while (done < count && !rc) {
+    got = gfn_mem_pin(kvm, gpa, count - done, pages);
+    if (got < 0) {
+      rc = got;
+      break;
+    }
+
+    for (i = 0; i < got; i++) {
+      len = min_t(size_t, PAGE_SIZE - (gpa & ~PAGE_MASK), count - done);
+      if (!rc) {
+        va = kmap_local_page(pages[i]);
+        if (copy_to_user(ubuf + done, va + (gpa & ~PAGE_MASK), len))
+          rc = -EFAULT;
+        kunmap_local(va);
+      }
+      if (!rc) {
+        done += len;
+        gpa += len;
+      }
+      put_page(pages[i]);
+    }
+
+    if (fatal_signal_pending(current))
+      break;
+  }
+
+  gfn_vm_unpin(kvm);
+
+  if (!done)
+    return rc;
+  *ppos = gpa;
+  return done;
+}
+
+/* The index removes the entry before dropping its reference, so vm lives. */
+static int gfn_map_open(struct inode *inode, struct file *file) {
+  struct gfn_vm *vm = pde_data(inode);
+
+  gfn_vm_get(vm);
+  file->private_data = vm;
+  return 0;
+}
+
+static int gfn_map_release(struct inode *inode, struct file *file) {
+  gfn_vm_put(file->private_data);
+  return 0;
+}
+
+/*
+ * Guest memory holds the guest's secrets whatever the VMM's owner allows,
+ * so like /dev/mem it takes CAP_SYS_RAWIO, checked once at open.
+ */
+static int gfn_mem_open(struct inode *inode, struct file *file) {
+  if (!capable(CAP_SYS_RAWIO))
+    return -EPERM;
+  return gfn_map_open(inode, file);
+}
+
+static const struct proc_ops gfn_map_fops = {
+    .proc_open = gfn_map_open,
+    .proc_release = gfn_map_release,
+    .proc_read = gfn_map_read,
+    .proc_lseek = default_llseek,
+};
+
+static const struct proc_ops gfn_mem_fops = {
+    .proc_open = gfn_mem_open,
+    .proc_release = gfn_map_release,
+    .proc_read = gfn_mem_read,
+    .proc_lseek = default_llseek,
+};
+
+/* Called under the index lock; a VM without these files still works. */
+void gfn_map_add(struct gfn_vm *vm) {
+  char name[16];
+
+  snprintf(name, sizeof(name), "%d", vm->pid);
+  vm->map_proc = proc_create_data(name, 0400, map_dir, &gfn_map_fops, vm);
+  vm->mem_proc = proc_create_data(name, 0400, mem_dir, &gfn_mem_fops, vm);
+}
+
+/* Waits for in-flight reads and closes open files. */
+void gfn_map_remove(struct gfn_vm *vm) {
+  proc_remove(vm->map_proc);
+  proc_remove(vm->mem_proc);
+  vm->map_proc = NULL;
+  vm->mem_proc = NULL;
+}
+
+int gfn_map_init(void) {
+  map_dir = proc_mkdir(MAP_PROC_DIR, NULL);
+  if (!map_dir)
+    return -ENOMEM;
+  mem_dir = proc_mkdir(MEM_PROC_DIR, NULL);
+  if (!mem_dir) {
+    proc_remove(map_dir);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+void gfn_map_exit(void) {
+  proc_remove(mem_dir);
+  proc_remove(map_dir);
+}
@@ -0,0 +1,16 @@
+#ifndef GFN_MAP_H
+#define GFN_MAP_H
+
+struct gfn_vm;
+
+/*
+ * /proc/gfn_to_pfn_map/<pid> and /proc/gfn_to_pfn_mem/<pid>, kept in step
+ * with the VM index.
+ */
+void gfn_map_add(struct gfn_vm *vm);
+void gfn_map_remove(struct gfn_vm *vm);
+
+int gfn_map_init(void);
+void gfn_map_exit(void);
+
+#endif /* GFN_MAP_H */
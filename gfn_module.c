@@ -1,44 +1,198 @@
 // gfn_module.c
 #include <asm/pgtable.h>
+#include <linux/bitmap.h>
 #include <linux/kernel.h>
 #include <linux/kvm.h>
+#include <linux/jump_label.h>
 #include <linux/kvm_host.h>
 #include <linux/mm.h>
 #include <linux/huge_mm.h>
+#include <linux/mmap_lock.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/poll.h>
 #include <linux/proc_fs.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/uaccess.h>
 #include <linux/wait.h>
 
+#include "gfn_chlog.h"
+#include "gfn_comp.h"
+#include "gfn_format.h"
+#include "gfn_gpt.h"
+#include "gfn_ioctl.h"
+#include "gfn_map.h"
 #include "gfn_parse.h"
+#include "gfn_ring.h"
+#include "gfn_rmap.h"
+#include "gfn_scan.h"
+#include "gfn_stats.h"
+#include "gfn_vm.h"
+#include "gfn_watch.h"
+#include "gfn_xlate.h"
+
+#define CREATE_TRACE_POINTS
+#include "gfn_trace.h"
 
 #define PROC_NAME "gfn_to_pfn"
 #define REPLY_MAX 256
+#define REPLIES_MAX 1024 /* per fd, queued but not yet read */
+
+struct gfn_reply {
+  struct list_head node;
+  size_t len;
+  char buf[REPLY_MAX];
+};
 
+/*
+ * Replies are queued FIFO, so one fd can keep many requests in flight;
+ * requests carrying tag=N get it echoed back in their reply.
+ */
 struct gfn_ctx {
   wait_queue_head_t wq;
-  bool reply_ready;
-  ssize_t reply_len;
-  char reply[REPLY_MAX];
+  struct gfn_ring *ring; /* set once by GFN_IOC_RING_SETUP */
+  u32 format;            /* enum gfn_format for new replies */
+
+  spinlock_t lock;   /* protects vm, replies, nr_replies and events_lost */
+  struct gfn_vm *vm; /* GFN_IOC_BIND_VM target, if any */
+  struct list_head replies;
+  unsigned int nr_replies;
+  unsigned int events_lost; /* watch events dropped on a full queue */
+
+  struct gfn_watcher watcher;
+
+  struct mutex write_lock;  /* serializes writers; protects stream */
+  struct gfn_stream stream; /* text request lines, split at any byte */
+  u64 parse_t;              /* start of the current parse phase */
+
+  struct mutex read_lock; /* serializes readers; protects read_off */
+  size_t read_off;        /* bytes of the head reply already read */
 };
 
 static struct proc_dir_entry *proc_entry;
 
-static void gfn_ctx_reply(struct gfn_ctx *ctx, const char *fmt, ...)
-    __printf(2, 3);
+/*
+ * pr_info() per text request, for debugging only. Tracepoints cover the
+ * same ground without flooding the ring buffer; the static key keeps the
+ * disabled path down to a patched-out jump.
+ */
+static DEFINE_STATIC_KEY_FALSE(gfn_log_key);
+static bool log_enable;
+
+static int gfn_log_param_set(const char *val, const struct kernel_param *kp) {
+  int rc = param_set_bool(val, kp);
+
+  if (rc)
+    return rc;
+  if (log_enable)
+    static_branch_enable(&gfn_log_key);
+  else
+    static_branch_disable(&gfn_log_key);
+  return 0;
+}
+
+static const struct kernel_param_ops gfn_log_param_ops = {
+    .set = gfn_log_param_set,
+    .get = param_get_bool,
+};
+module_param_cb(log, &gfn_log_param_ops, &log_enable, 0644);
+MODULE_PARM_DESC(log, "Log every text request with pr_info (default: off)");
+
+static void gfn_record_init(struct gfn_record *rec,
+                            enum gfn_record_type type) {
+  *rec = (struct gfn_record){
+      .version = GFN_RECORD_VERSION,
+      .size = sizeof(*rec),
+      .type = type,
+      .node = GFN_NODE_NONE,
+  };
+}
+
+/* Replies are rendered once, in the format the fd has when they queue. */
+static void gfn_reply_set(struct gfn_ctx *ctx, struct gfn_reply *r,
+                          const struct gfn_record *rec) {
+  r->len = gfn_format_record(r->buf, REPLY_MAX, READ_ONCE(ctx->format), rec,
+                             gfn_zone_name(rec->node, rec->zone));
+}
 
-static void gfn_ctx_reply(struct gfn_ctx *ctx, const char *fmt, ...) {
-  va_list args;
+static bool gfn_ctx_has_reply(struct gfn_ctx *ctx) {
+  return READ_ONCE(ctx->nr_replies) != 0;
+}
 
-  va_start(args, fmt);
-  ctx->reply_len = vscnprintf(ctx->reply, REPLY_MAX, fmt, args);
-  va_end(args);
+static bool gfn_ctx_has_room(struct gfn_ctx *ctx) {
+  return READ_ONCE(ctx->nr_replies) < REPLIES_MAX;
 }
 
-static void gfn_log_result(const struct gfn_request *req, const struct kvm *kvm,
-                           const char *reply) {
+static void gfn_ctx_queue(struct gfn_ctx *ctx, struct gfn_reply *r) {
+  spin_lock(&ctx->lock);
+  list_add_tail(&r->node, &ctx->replies);
+  ctx->nr_replies++;
+  spin_unlock(&ctx->lock);
+  wake_up_interruptible(&ctx->wq);
+}
+
+/*
+ * Watch event from a VM's mmu_notifier: atomic context, so the reply is
+ * allocated without sleeping, and dropped (and counted) when that fails or
+ * the queue is full rather than blocking the invalidation.
+ */
+static void gfn_ctx_watch_event(struct gfn_watcher *wr, pid_t pid, gfn_t gfn,
+                                unsigned long npages, u64 cookie) {
+  struct gfn_ctx *ctx = container_of(wr, struct gfn_ctx, watcher);
+  struct gfn_reply *r = NULL;
+  struct gfn_record rec;
+
+  if (gfn_ctx_has_room(ctx))
+    r = kmalloc(sizeof(*r), GFP_NOWAIT | __GFP_NOWARN);
+  if (!r) {
+    spin_lock(&ctx->lock);
+    ctx->events_lost++;
+    spin_unlock(&ctx->lock);
+    return;
+  }
+  gfn_record_init(&rec, GFN_RECORD_INVAL);
+  rec.vm_pid = pid;
+  rec.gpa = (u64)gfn << PAGE_SHIFT;
+  rec.npages = npages;
+  rec.cookie = cookie;
+  gfn_reply_set(ctx, r, &rec);
+  gfn_ctx_queue(ctx, r);
+}
+
+/* After a read has made room, report any events dropped before it. */
+static void gfn_ctx_flush_lost(struct gfn_ctx *ctx) {
+  struct gfn_record rec;
+  struct gfn_reply *r;
+  unsigned int lost;
+
+  if (!READ_ONCE(ctx->events_lost) || !gfn_ctx_has_room(ctx))
+    return;
+  r = kmalloc(sizeof(*r), GFP_KERNEL);
+  if (!r)
+    return;
+
+  spin_lock(&ctx->lock);
+  lost = ctx->events_lost;
+  ctx->events_lost = 0;
+  spin_unlock(&ctx->lock);
+  if (!lost) {
+    kfree(r);
+    return;
+  }
+  gfn_record_init(&rec, GFN_RECORD_OVERFLOW);
+  rec.cookie = lost;
+  gfn_reply_set(ctx, r, &rec);
+  gfn_ctx_queue(ctx, r);
+}
+
+/* Logged as the text reply, whatever format the fd reads. */
+static void __gfn_log_result(const struct gfn_request *req,
+                             const struct kvm *kvm,
+                             const struct gfn_record *rec) {
+  struct gfn_record plain = *rec;
   unsigned long pid = 0;
   char msg[REPLY_MAX];
 
@@ -47,70 +201,59 @@ static void gfn_log_result(const struct gfn_request *req, const struct kvm *kvm,
   else if (req && req->has_pid)
     pid = req->vm_pid;
 
-  strscpy(msg, reply ? reply : "", sizeof(msg));
+  plain.flags &= ~GFN_RECORD_HAS_TAG;
+  gfn_format_record(msg, sizeof(msg), GFN_FORMAT_TEXT, &plain,
+                    gfn_zone_name(plain.node, plain.zone));
   strim(msg);
 
   pr_info("gfn_to_pfn: pid=%lu gfn=0x%lx %s", pid,
-          req ? req->raw_gfn : 0UL, msg[0] ? msg : "(empty reply)");
+          req ? req->raw_gfn : 0UL, msg);
 }
 
-/* --- helper: format info about page --- */
-static ssize_t format_page_info(char *dst, size_t cap, struct mm_struct *mm,
-                                unsigned long hva, unsigned long gpa) {
-  long ret;
-  struct page *pages[1] = {NULL};
-  unsigned long base_va = hva & PAGE_MASK;
-  unsigned long offset = hva & 0xFFF;
-
-  ret = get_user_pages_remote(mm, base_va, 1, FOLL_GET, pages, NULL);
-  if (ret <= 0)
-    return scnprintf(dst, cap, "err:gup=%ld\n", ret);
-
-  {
-    struct page *page = pages[0];
-    unsigned long pfn = page_to_pfn(page);
-    phys_addr_t phys_base = PFN_PHYS(pfn);
-    phys_addr_t exact_phys = phys_base | offset;
-
-    const char *kind = "base";
-    if (PageTransHuge(page))
-      kind = "thp";
-    else if (PageHuge(page))
-      kind = "hugetlb";
+static inline void gfn_log_result(const struct gfn_request *req,
+                                  const struct kvm *kvm,
+                                  const struct gfn_record *rec) {
+  if (static_branch_unlikely(&gfn_log_key))
+    __gfn_log_result(req, kvm, rec);
+}
 
-    ret = scnprintf(dst, cap, "ok phys=0x%llx kind=%s gpa=0x%lx hva=0x%lx\n",
-                    (unsigned long long)exact_phys, kind, gpa, hva);
+/* --- VM for a request: named pid, else the fd's binding, else the first --- */
+static struct gfn_vm *gfn_ctx_vm(struct gfn_ctx *ctx, bool has_pid,
+                                 unsigned long vm_pid) {
+  struct gfn_vm *vm;
 
-    put_page(page);
+  if (!has_pid) {
+    spin_lock(&ctx->lock);
+    vm = ctx->vm;
+    if (vm)
+      gfn_vm_get(vm);
+    spin_unlock(&ctx->lock);
+    if (vm)
+      return vm;
   }
-  return ret;
+  return gfn_vm_lookup(has_pid, vm_pid);
 }
 
-/* --- locate VM by pid --- */
-static int find_kvm_by_pid(unsigned long vm_pid, struct kvm **out) {
-  struct kvm *kvm;
-  bool found = false;
+/* Resolve and pin the VM for a binary request; vm_pid 0 means default. */
+static int gfn_ctx_enter(struct gfn_ctx *ctx, u64 vm_pid, struct gfn_vm **vmp,
+                         struct kvm **kvmp) {
+  struct gfn_vm *vm = gfn_ctx_vm(ctx, vm_pid != 0, vm_pid);
 
-  list_for_each_entry(kvm, &vm_list, vm_list) {
-    if (kvm->userspace_pid == vm_pid) {
-      *out = kvm;
-      found = true;
-      break;
-    }
+  if (IS_ERR(vm))
+    return PTR_ERR(vm);
+
+  *kvmp = gfn_vm_pin(vm);
+  if (!*kvmp) {
+    gfn_vm_put(vm);
+    return -ESRCH;
   }
-  return found ? 0 : -ESRCH;
+  *vmp = vm;
+  return 0;
 }
 
-/* --- translate gfn to hva --- */
-static long gfn_to_hva_safe(struct kvm *kvm, unsigned long full_gfn,
-                            unsigned long *out_hva) {
-  gfn_t gfn = (gfn_t)(full_gfn >> 12);
-  unsigned long off = full_gfn & 0xFFF;
-  unsigned long hva = gfn_to_hva(kvm, gfn);
-  if (kvm_is_error_hva(hva))
-    return -EFAULT;
-  *out_hva = hva | off;
-  return 0;
+static void gfn_ctx_leave(struct gfn_vm *vm, struct kvm *kvm) {
+  gfn_vm_unpin(kvm);
+  gfn_vm_put(vm);
 }
 
 /* --- per-file lifecycle --- */
@@ -119,119 +262,1095 @@ static int gfn_open(struct inode *ino, struct file *f) {
   if (!ctx)
     return -ENOMEM;
   init_waitqueue_head(&ctx->wq);
+  spin_lock_init(&ctx->lock);
+  INIT_LIST_HEAD(&ctx->replies);
+  mutex_init(&ctx->read_lock);
+  gfn_watcher_init(&ctx->watcher, gfn_ctx_watch_event);
+  mutex_init(&ctx->write_lock);
+  gfn_stream_init(&ctx->stream);
   f->private_data = ctx;
   return 0;
 }
 
 static int gfn_release(struct inode *ino, struct file *f) {
-  kfree(f->private_data);
+  struct gfn_ctx *ctx = f->private_data;
+  struct gfn_reply *r, *tmp;
+
+  gfn_ring_destroy(ctx->ring);
+  gfn_watcher_clear(&ctx->watcher);
+  gfn_stream_destroy(&ctx->stream);
+  gfn_vm_put(ctx->vm);
+  list_for_each_entry_safe(r, tmp, &ctx->replies, node)
+    kfree(r);
+  kfree(ctx);
   return 0;
 }
 
-/* --- write request --- */
-static ssize_t gfn_write(struct file *file, const char __user *ubuf,
-                         size_t count, loff_t *ppos) {
-  struct gfn_ctx *ctx = file->private_data;
-  struct gfn_request req;
-  struct kvm *kvm = NULL;
-  unsigned long hva;
-  ssize_t n;
-  char kbuf[64];
+/* --- write requests: one reply per GFN, queued in input order --- */
+static int gfn_text_reply(struct gfn_ctx *ctx, const struct gfn_request *req,
+                          const struct kvm *kvm, struct gfn_record *rec) {
+  struct gfn_reply *r = kmalloc(sizeof(*r), GFP_KERNEL);
 
-  if (count >= sizeof(kbuf))
-    return -E2BIG;
+  if (!r)
+    return -ENOMEM;
+  rec->gpa = req->raw_gfn;
+  if (req->has_tag) {
+    rec->flags |= GFN_RECORD_HAS_TAG;
+    rec->tag = req->tag;
+  }
+  gfn_log_result(req, kvm, rec);
+  gfn_reply_set(ctx, r, rec);
+  gfn_ctx_queue(ctx, r);
+  return 0;
+}
 
-  if (copy_from_user(kbuf, ubuf, count))
-    return -EFAULT;
+/* Same reply for every GFN of a line that never reached translation. */
+static int gfn_text_fail(struct gfn_ctx *ctx, struct gfn_request *req,
+                         const struct gfn_line *line, enum gfn_stat stat,
+                         enum gfn_record_err err, int error, u64 vm_pid) {
+  struct gfn_record rec;
+  size_t i, n = line->nr ? line->nr : 1;
+  int rc;
 
-  kbuf[count] = '\0';
-  ctx->reply_ready = false;
-  ctx->reply_len = 0;
+  for (i = 0; i < n; i++) {
+    gfn_record_init(&rec, GFN_RECORD_RESULT);
+    rec.err = err;
+    rec.error = error;
+    rec.vm_pid = vm_pid;
+    req->raw_gfn = line->nr ? line->gfns[i] : 0;
+    gfn_stat_inc(GFN_STAT_REQUESTS);
+    gfn_stat_inc(stat);
+    rc = gfn_text_reply(ctx, req, NULL, &rec);
+    if (rc)
+      return rc;
+  }
+  return 0;
+}
 
-  if (gfn_parse_request(kbuf, &req)) {
-    gfn_ctx_reply(ctx, "err:invalid_input\n");
-    gfn_log_result(&req, NULL, ctx->reply);
-    goto out_ready;
+/* kvm->srcu and the mmap read lock held. */
+static int gfn_text_xlate(struct gfn_ctx *ctx, struct gfn_vm *vm,
+                          struct kvm *kvm, const struct gfn_request *req) {
+  struct gfn_xlate_result res = {0};
+  struct gfn_record rec;
+  unsigned long hva;
+  long gup;
+  int rc;
+  u64 t;
+
+  gfn_record_init(&rec, GFN_RECORD_RESULT);
+  rec.vm_pid = vm->pid;
+  gfn_stat_inc(GFN_STAT_REQUESTS);
+  trace_gfn_request(req->raw_gfn, req->has_pid ? req->vm_pid : 0,
+                    req->has_tag ? req->tag : 0);
+
+  t = gfn_stat_start();
+  if (gfn_to_hva_safe(kvm, req->raw_gfn, &hva)) {
+    gfn_stat_phase(GFN_PHASE_HVA, t);
+    gfn_stat_inc(GFN_STAT_ERR_HVA);
+    rec.err = GFN_RECORD_ERR_HVA;
+    rec.error = -EFAULT;
+    return gfn_text_reply(ctx, req, kvm, &rec);
   }
+  t = gfn_stat_phase(GFN_PHASE_HVA, t);
 
-  if (req.has_pid) {
-    int rc = find_kvm_by_pid(req.vm_pid, &kvm);
-    if (rc) {
-      gfn_ctx_reply(ctx, "err:no_vm pid=%lu\n", req.vm_pid);
-      gfn_log_result(&req, NULL, ctx->reply);
-      goto out_ready;
-    }
+  res.gpa = req->raw_gfn;
+  res.hva = hva;
+  gup = gfn_vm_xlate_page(vm, kvm->mm, &res);
+  t = gfn_stat_phase(GFN_PHASE_XLATE, t);
+
+  if (gup <= 0) {
+    gfn_stat_inc(GFN_STAT_ERR_GUP);
+    rec.err = GFN_RECORD_ERR_GUP;
+    rec.error = gup;
   } else {
-    kvm = list_first_entry_or_null(&vm_list, struct kvm, vm_list);
-    if (!kvm) {
-      gfn_ctx_reply(ctx, "err:no_vms\n");
-      gfn_log_result(&req, NULL, ctx->reply);
-      goto out_ready;
-    }
+    gfn_stat_inc(GFN_STAT_OK);
+    gfn_stat_inc(GFN_STAT_KIND + res.kind);
+    rec.phys = res.phys;
+    rec.hva = res.hva;
+    rec.kind = res.kind;
+    rec.node = res.node;
+    rec.zone = res.zone;
   }
+  rc = gfn_text_reply(ctx, req, kvm, &rec);
+  gfn_stat_phase(GFN_PHASE_FORMAT, t);
+  return rc;
+}
+
+/*
+ * Translate one line (or GFN_LINE_MAX GFNs of a long one). The VM is
+ * resolved and pinned once, and the whole line is translated under one
+ * kvm->srcu and mmap lock hold, like a batch ioctl.
+ */
+static int __gfn_text_line(struct gfn_ctx *ctx, const struct gfn_line *line) {
+  struct gfn_request req = {
+      .vm_pid = line->vm_pid,
+      .tag = line->tag,
+      .has_pid = line->has_pid,
+      .has_tag = line->has_tag,
+  };
+  struct gfn_vm *vm;
+  struct kvm *kvm;
+  size_t i;
+  int rc = 0, idx;
+  u64 t;
 
-  if (gfn_to_hva_safe(kvm, req.raw_gfn, &hva)) {
-    gfn_ctx_reply(ctx, "err:hva gfn=0x%lx\n", req.raw_gfn);
-    gfn_log_result(&req, kvm, ctx->reply);
-    goto out_ready;
+  if (line->error)
+    return gfn_text_fail(ctx, &req, line, GFN_STAT_ERR_INPUT,
+                         GFN_RECORD_ERR_INPUT, line->error, req.vm_pid);
+
+  t = gfn_stat_start();
+  vm = gfn_ctx_vm(ctx, req.has_pid, req.vm_pid);
+  if (IS_ERR(vm)) {
+    gfn_stat_phase(GFN_PHASE_VM, t);
+    if (PTR_ERR(vm) == -ESRCH)
+      return gfn_text_fail(ctx, &req, line, GFN_STAT_ERR_NO_VM,
+                           GFN_RECORD_ERR_NO_VM, -ESRCH, req.vm_pid);
+    return gfn_text_fail(ctx, &req, line, GFN_STAT_ERR_NO_VMS,
+                         GFN_RECORD_ERR_NO_VMS, PTR_ERR(vm), req.vm_pid);
   }
 
-  n = format_page_info(ctx->reply, REPLY_MAX, kvm->mm, hva, req.raw_gfn);
-  ctx->reply_len = clamp_t(ssize_t, n, 0, REPLY_MAX);
-  gfn_log_result(&req, kvm, ctx->reply);
+  kvm = gfn_vm_pin(vm);
+  gfn_stat_phase(GFN_PHASE_VM, t);
+  if (!kvm) {
+    pid_t pid = vm->pid;
 
-out_ready:
-  ctx->reply_ready = true;
-  wake_up_interruptible(&ctx->wq);
-  return count;
+    gfn_vm_put(vm);
+    return gfn_text_fail(ctx, &req, line, GFN_STAT_ERR_NO_VM,
+                         GFN_RECORD_ERR_NO_VM, -ESRCH, pid);
+  }
+
+  idx = srcu_read_lock(&kvm->srcu);
+  mmap_read_lock(kvm->mm);
+  for (i = 0; i < line->nr && !rc; i++) {
+    req.raw_gfn = line->gfns[i];
+    rc = gfn_text_xlate(ctx, vm, kvm, &req);
+  }
+  mmap_read_unlock(kvm->mm);
+  srcu_read_unlock(&kvm->srcu, idx);
+
+  gfn_vm_unpin(kvm);
+  gfn_vm_put(vm);
+  return rc;
 }
 
-/* --- read reply --- */
+/*
+ * Tokenizer callback; the parse phase is the time between lines. A line is
+ * only taken while the reply queue has room, so a write overshoots the
+ * limit by at most one line part.
+ */
+static int gfn_text_line(void *arg, const struct gfn_line *line) {
+  struct gfn_ctx *ctx = arg;
+  int rc;
+
+  if (!gfn_ctx_has_room(ctx))
+    return -EAGAIN;
+  gfn_stat_phase(GFN_PHASE_PARSE, ctx->parse_t);
+  rc = __gfn_text_line(ctx, line);
+  ctx->parse_t = gfn_stat_start();
+  return rc;
+}
+
+/*
+ * Text requests are a stream of lines, each a list of GFNs with optional
+ * pid= and tag= keys (or the legacy "gfn pid"), and may be split across
+ * writes at any byte. Replies are queued as lines complete. When the queue
+ * fills, the bytes taken so far are returned; the line that did not fit is
+ * kept and handed over again when the rest is written. A write that takes
+ * nothing waits for a read, or fails with -EAGAIN on a non-blocking fd.
+ */
+static ssize_t gfn_write(struct file *file, const char __user *ubuf,
+                         size_t count, loff_t *ppos) {
+  struct gfn_ctx *ctx = file->private_data;
+  size_t off = 0, n, used;
+  char kbuf[256];
+  int rc = 0;
+
+  mutex_lock(&ctx->write_lock);
+  while (off < count) {
+    n = min(count - off, sizeof(kbuf));
+    if (copy_from_user(kbuf, ubuf + off, n)) {
+      rc = -EFAULT;
+      break;
+    }
+    ctx->parse_t = gfn_stat_start();
+    rc = gfn_stream_feed(&ctx->stream, kbuf, n, &used, gfn_text_line, ctx);
+    off += used;
+    if (!rc)
+      continue;
+    if (rc != -EAGAIN || off || (file->f_flags & O_NONBLOCK))
+      break;
+
+    mutex_unlock(&ctx->write_lock);
+    if (wait_event_interruptible(ctx->wq, gfn_ctx_has_room(ctx)))
+      return -ERESTARTSYS;
+    mutex_lock(&ctx->write_lock);
+  }
+  mutex_unlock(&ctx->write_lock);
+
+  if (off)
+    return off;
+  return rc;
+}
+
+/* --- read replies: as many whole ones as fit, oldest first --- */
 static ssize_t gfn_read(struct file *file, char __user *ubuf, size_t len,
                         loff_t *ppos) {
   struct gfn_ctx *ctx = file->private_data;
+  struct gfn_reply *r;
+  ssize_t done = 0;
+  size_t chunk;
 
-  if (!ctx->reply_ready) {
+  if (!gfn_ctx_has_reply(ctx)) {
     if (file->f_flags & O_NONBLOCK)
       return -EAGAIN;
-    if (wait_event_interruptible(ctx->wq, ctx->reply_ready))
+    if (wait_event_interruptible(ctx->wq, gfn_ctx_has_reply(ctx)))
       return -ERESTARTSYS;
   }
 
-  if (!ctx->reply_len)
+  mutex_lock(&ctx->read_lock);
+  while (done < len) {
+    spin_lock(&ctx->lock);
+    r = list_first_entry_or_null(&ctx->replies, struct gfn_reply, node);
+    spin_unlock(&ctx->lock);
+    if (!r)
+      break;
+
+    /* Only the first reply of a read may be split across reads. */
+    chunk = min(r->len - ctx->read_off, len - done);
+    if (done && chunk < r->len - ctx->read_off)
+      break;
+
+    if (copy_to_user(ubuf + done, r->buf + ctx->read_off, chunk)) {
+      if (!done)
+        done = -EFAULT;
+      break;
+    }
+    done += chunk;
+    ctx->read_off += chunk;
+    if (ctx->read_off < r->len)
+      break;
+
+    spin_lock(&ctx->lock);
+    list_del(&r->node);
+    ctx->nr_replies--;
+    spin_unlock(&ctx->lock);
+    ctx->read_off = 0;
+    kfree(r);
+  }
+  mutex_unlock(&ctx->read_lock);
+
+  if (done > 0) {
+    gfn_ctx_flush_lost(ctx);
+    wake_up_interruptible(&ctx->wq);
+  }
+  return done;
+}
+
+/* --- batched binary translation --- */
+static long gfn_ioctl_xlate_batch(struct gfn_ctx *ctx,
+                                  struct gfn_xlate_batch __user *uarg) {
+  struct gfn_xlate_batch batch;
+  struct gfn_xlate_req *reqs;
+  struct gfn_xlate_result *res;
+  struct gfn_vm *vm;
+  struct kvm *kvm;
+  u32 i;
+  int rc, idx;
+
+  if (copy_from_user(&batch, uarg, sizeof(batch)))
+    return -EFAULT;
+  if (batch.flags || !batch.count || batch.count > GFN_XLATE_BATCH_MAX)
+    return -EINVAL;
+
+  reqs = vmemdup_user(u64_to_user_ptr(batch.reqs),
+                      array_size(batch.count, sizeof(*reqs)));
+  if (IS_ERR(reqs))
+    return PTR_ERR(reqs);
+
+  res = kvcalloc(batch.count, sizeof(*res), GFP_KERNEL);
+  if (!res) {
+    kvfree(reqs);
+    return -ENOMEM;
+  }
+
+  rc = gfn_ctx_enter(ctx, batch.vm_pid, &vm, &kvm);
+  if (rc)
+    goto out_free;
+
+  idx = srcu_read_lock(&kvm->srcu);
+  mmap_read_lock(kvm->mm);
+  for (i = 0; i < batch.count; i++)
+    gfn_xlate_one(kvm, vm, &reqs[i], &res[i]);
+  mmap_read_unlock(kvm->mm);
+  srcu_read_unlock(&kvm->srcu, idx);
+  gfn_ctx_leave(vm, kvm);
+
+  if (copy_to_user(u64_to_user_ptr(batch.results), res,
+                   array_size(batch.count, sizeof(*res))))
+    rc = -EFAULT;
+
+out_free:
+  kvfree(res);
+  kvfree(reqs);
+  return rc;
+}
+
+/* --- host-physical contiguity of a guest range --- */
+static long gfn_ioctl_contig(struct gfn_ctx *ctx,
+                             struct gfn_contig_query __user *uarg) {
+  struct gfn_contig_sink cs = {0};
+  struct gfn_extent __user *out;
+  struct gfn_contig_query q;
+  struct gfn_vm *vm;
+  struct kvm *kvm;
+  gfn_t gfn, end, stop;
+  u64 backed;
+  int rc, idx;
+
+  if (copy_from_user(&q, uarg, sizeof(q)))
+    return -EFAULT;
+  if ((q.flags & ~GFN_XLATE_NOFAULT) || q.reserved || !q.npages)
+    return -EINVAL;
+
+  gfn = q.start_gfn >> PAGE_SHIFT;
+  end = gfn + q.npages;
+  if (end < gfn)
+    return -EINVAL;
+
+  cs.left = q.max_segments;
+  cs.cap = min_t(u32, q.max_segments, GFN_EXTENT_STAGE);
+  if (cs.cap) {
+    cs.out = kvmalloc_array(cs.cap, sizeof(*cs.out), GFP_KERNEL);
+    if (!cs.out)
+      return -ENOMEM;
+  }
+
+  rc = gfn_ctx_enter(ctx, q.vm_pid, &vm, &kvm);
+  if (rc) {
+    kvfree(cs.out);
+    return rc;
+  }
+
+  /*
+   * One walk, GFN_RANGE_STAGE pages per lock hold. Staged segments are
+   * copied out after each window; the open one carries over.
+   */
+  out = u64_to_user_ptr(q.segments);
+  for (;;) {
+    stop = min_t(gfn_t, end, gfn + GFN_RANGE_STAGE);
+
+    idx = srcu_read_lock(&kvm->srcu);
+    mmap_read_lock(kvm->mm);
+    gfn = gfn_xlate_contig(kvm, gfn, stop, q.flags, &cs);
+    mmap_read_unlock(kvm->mm);
+    srcu_read_unlock(&kvm->srcu, idx);
+    if (gfn >= end)
+      gfn_contig_close(&cs);
+
+    if (copy_to_user(out, cs.out, array_size(cs.n, sizeof(*cs.out)))) {
+      rc = -EFAULT;
+      break;
+    }
+    out += cs.n;
+    cs.left -= cs.n;
+    cs.n = 0;
+    cs.cap = min_t(u64, cs.left, GFN_EXTENT_STAGE);
+
+    if (gfn >= end && !cs.cur.length)
+      break;
+    if (fatal_signal_pending(current)) {
+      rc = -EINTR;
+      break;
+    }
+  }
+
+  gfn_ctx_leave(vm, kvm);
+  kvfree(cs.out);
+  if (rc)
+    return rc;
+
+  backed = q.npages - cs.unbacked;
+  q.nr_segments = cs.nr;
+  q.unbacked = cs.unbacked;
+  q.largest_gpa = cs.largest.gpa_start;
+  q.largest_hpa = cs.largest.hpa_start;
+  q.largest_len = cs.largest.length;
+  q.score = backed > 1 ? div64_u64((cs.nr - 1) * 1000, backed - 1) : 0;
+  if (copy_to_user(uarg, &q, sizeof(q)))
+    return -EFAULT;
+  return 0;
+}
+
+/* --- guest virtual addresses, through the guest's own page tables --- */
+static long gfn_ioctl_gva_xlate(struct gfn_ctx *ctx,
+                                struct gfn_gva_xlate __user *uarg) {
+  struct gfn_xlate_result *res;
+  struct gfn_gva_xlate q;
+  struct gfn_gpt *gpt;
+  struct gfn_vm *vm;
+  struct kvm *kvm;
+  u64 *gvas = NULL;
+  u32 i;
+  int rc, idx;
+
+  if (copy_from_user(&q, uarg, sizeof(q)))
+    return -EFAULT;
+  if ((q.flags & ~(GFN_XLATE_NOFAULT | GFN_GVA_LA57)) || !q.count ||
+      q.count > GFN_XLATE_BATCH_MAX)
+    return -EINVAL;
+
+  if (q.gvas) {
+    gvas = vmemdup_user(u64_to_user_ptr(q.gvas),
+                        array_size(q.count, sizeof(*gvas)));
+    if (IS_ERR(gvas))
+      return PTR_ERR(gvas);
+  }
+
+  res = kvcalloc(q.count, sizeof(*res), GFP_KERNEL);
+  gpt = gfn_gpt_create(q.root, q.flags);
+  if (!res || !gpt) {
+    rc = -ENOMEM;
+    goto out_free;
+  }
+
+  rc = gfn_ctx_enter(ctx, q.vm_pid, &vm, &kvm);
+  if (rc)
+    goto out_free;
+
+  idx = srcu_read_lock(&kvm->srcu);
+  mmap_read_lock(kvm->mm);
+  for (i = 0; i < q.count; i++)
+    gfn_gpt_xlate(gpt, kvm, vm,
+                  gvas ? gvas[i] : q.start_gva + ((u64)i << PAGE_SHIFT),
+                  &res[i]);
+  mmap_read_unlock(kvm->mm);
+  srcu_read_unlock(&kvm->srcu, idx);
+  gfn_ctx_leave(vm, kvm);
+
+  if (copy_to_user(u64_to_user_ptr(q.results), res,
+                   array_size(q.count, sizeof(*res))))
+    rc = -EFAULT;
+
+out_free:
+  gfn_gpt_destroy(gpt);
+  kvfree(res);
+  kvfree(gvas);
+  return rc;
+}
+
+/* --- contiguous range translation --- */
+static long gfn_ioctl_xlate_range(struct gfn_ctx *ctx,
+                                  struct gfn_xlate_range __user *uarg) {
+  struct gfn_xlate_range range;
+  struct gfn_xlate_result __user *out;
+  struct gfn_xlate_result *stage;
+  u64 *nodes = NULL;
+  struct gfn_vm *vm;
+  struct kvm *kvm;
+  gfn_t gfn, end;
+  size_t cap, n, i;
+  int rc;
+
+  if (copy_from_user(&range, uarg, sizeof(range)))
+    return -EFAULT;
+  if ((range.flags & ~GFN_XLATE_NOFAULT) || !range.npages ||
+      range.npages > GFN_XLATE_RANGE_MAX || range.nr_nodes > MAX_NUMNODES)
+    return -EINVAL;
+
+  gfn = range.start_gfn >> PAGE_SHIFT;
+  end = gfn + range.npages;
+  if (end < gfn)
+    return -EINVAL;
+
+  cap = min_t(u64, range.npages, GFN_RANGE_STAGE);
+  stage = kvmalloc_array(cap, sizeof(*stage), GFP_KERNEL);
+  if (!stage)
+    return -ENOMEM;
+
+  if (range.nr_nodes) {
+    nodes = kcalloc(range.nr_nodes, sizeof(*nodes), GFP_KERNEL);
+    if (!nodes) {
+      kvfree(stage);
+      return -ENOMEM;
+    }
+  }
+
+  rc = gfn_ctx_enter(ctx, range.vm_pid, &vm, &kvm);
+  if (rc)
+    goto out_free;
+
+  /*
+   * The span is translated one staging buffer at a time, by the scan
+   * workers when it is large enough, and copied out in between, like
+   * pagemap_read(). The per-node tally is taken from each buffer on the
+   * way out.
+   */
+  out = u64_to_user_ptr(range.results);
+  while (gfn < end) {
+    n = min_t(u64, end - gfn, cap);
+    gfn_scan(kvm, gfn, gfn + n, range.flags, GFN_SCAN_RESULTS, stage);
+    gfn += n;
+
+    for (i = 0; nodes && i < n; i++) {
+      if (!stage[i].error && stage[i].node >= 0 &&
+          stage[i].node < range.nr_nodes)
+        nodes[stage[i].node]++;
+    }
+
+    if (copy_to_user(out, stage, array_size(n, sizeof(*stage)))) {
+      rc = -EFAULT;
+      break;
+    }
+    out += n;
+
+    if (fatal_signal_pending(current)) {
+      rc = -EINTR;
+      break;
+    }
+  }
+
+  gfn_ctx_leave(vm, kvm);
+
+  if (!rc && nodes &&
+      copy_to_user(u64_to_user_ptr(range.node_pages), nodes,
+                   array_size(range.nr_nodes, sizeof(*nodes))))
+    rc = -EFAULT;
+
+out_free:
+  kfree(nodes);
+  kvfree(stage);
+  return rc;
+}
+
+/* --- range translation collapsed into extents --- */
+static long gfn_ioctl_xlate_extents(struct gfn_ctx *ctx,
+                                    struct gfn_xlate_extents __user *uarg) {
+  struct gfn_xlate_extents req;
+  struct gfn_extent_sink es = {0};
+  struct gfn_extent __user *out;
+  struct gfn_vm *vm;
+  struct kvm *kvm;
+  gfn_t gfn, end, stop;
+  u32 written = 0;
+  size_t flush;
+  bool done;
+  int rc, idx;
+
+  if (copy_from_user(&req, uarg, sizeof(req)))
+    return -EFAULT;
+  if ((req.flags & ~GFN_XLATE_NOFAULT) || req.reserved || !req.npages ||
+      !req.max_extents)
+    return -EINVAL;
+
+  gfn = req.start_gfn >> PAGE_SHIFT;
+  end = gfn + req.npages;
+  if (end < gfn)
+    return -EINVAL;
+
+  es.out = kvmalloc_array(min_t(u32, req.max_extents, GFN_EXTENT_STAGE),
+                          sizeof(*es.out), GFP_KERNEL);
+  if (!es.out)
+    return -ENOMEM;
+
+  rc = gfn_ctx_enter(ctx, req.vm_pid, &vm, &kvm);
+  if (rc) {
+    kvfree(es.out);
+    return rc;
+  }
+
+  /*
+   * GFN_RANGE_STAGE pages per lock hold, as for the contiguity query.
+   * After each pass everything but the last staged extent is flushed; the
+   * last one stays behind so the next pass can still grow it.
+   */
+  out = u64_to_user_ptr(req.extents);
+  do {
+    stop = min_t(gfn_t, end, gfn + GFN_RANGE_STAGE);
+    es.cap = min_t(u32, req.max_extents - written, GFN_EXTENT_STAGE);
+
+    idx = srcu_read_lock(&kvm->srcu);
+    mmap_read_lock(kvm->mm);
+    gfn = gfn_xlate_extents(kvm, gfn, stop, req.flags, &es);
+    mmap_read_unlock(kvm->mm);
+    srcu_read_unlock(&kvm->srcu, idx);
+
+    /* A pass that stops short of its window filled the buffer. */
+    done = gfn >= end ||
+           (gfn < stop && written + es.n == req.max_extents);
+    flush = done ? es.n : es.n - 1;
+    if (copy_to_user(out + written, es.out,
+                     array_size(flush, sizeof(*es.out)))) {
+      rc = -EFAULT;
+      break;
+    }
+    written += flush;
+    if (!done) {
+      es.out[0] = es.out[es.n - 1];
+      es.n = 1;
+    }
+
+    if (fatal_signal_pending(current)) {
+      rc = -EINTR;
+      break;
+    }
+  } while (!done);
+
+  gfn_ctx_leave(vm, kvm);
+  kvfree(es.out);
+  if (rc)
+    return rc;
+
+  req.count = written;
+  req.next_gfn = (u64)gfn << PAGE_SHIFT;
+  if (copy_to_user(uarg, &req, sizeof(req)))
+    return -EFAULT;
+  return 0;
+}
+
+/* --- shared-memory submission/completion rings --- */
+static long gfn_ioctl_ring_setup(struct gfn_ctx *ctx,
+                                 struct gfn_ring_setup __user *uarg) {
+  struct gfn_ring_setup setup;
+  struct gfn_ring *ring;
+  struct gfn_vm *vm;
+
+  if (copy_from_user(&setup, uarg, sizeof(setup)))
+    return -EFAULT;
+  if (setup.flags || setup.reserved ||
+      memchr_inv(setup.reserved2, 0, sizeof(setup.reserved2)))
+    return -EINVAL;
+
+  vm = gfn_ctx_vm(ctx, setup.vm_pid != 0, setup.vm_pid);
+  if (IS_ERR(vm))
+    return PTR_ERR(vm);
+
+  ring = gfn_ring_create(&setup, vm, &ctx->wq);
+  if (IS_ERR(ring)) {
+    gfn_vm_put(vm);
+    return PTR_ERR(ring);
+  }
+
+  if (cmpxchg_release(&ctx->ring, NULL, ring)) {
+    gfn_ring_destroy(ring);
+    return -EBUSY;
+  }
+  return 0;
+}
+
+static long gfn_ioctl_ring_enter(struct gfn_ctx *ctx) {
+  struct gfn_ring *ring = smp_load_acquire(&ctx->ring);
+
+  if (!ring)
+    return -ENXIO;
+  gfn_ring_kick(ring);
+  return 0;
+}
+
+/* --- accessed/dirty sampling --- */
+static int gfn_access_copy(u64 uptr, u64 *words, const unsigned long *bits,
+                           size_t nbits, size_t off) {
+  if (!uptr)
     return 0;
+  bitmap_to_arr64(words, bits, nbits);
+  if (copy_to_user(u64_to_user_ptr(uptr) + off, words,
+                   BITS_TO_U64(nbits) * sizeof(u64)))
+    return -EFAULT;
+  return 0;
+}
+
+static long gfn_ioctl_access_bits(struct gfn_ctx *ctx,
+                                  struct gfn_access_bits __user *uarg) {
+  struct gfn_access_sink as = {0};
+  struct gfn_access_bits req;
+  struct gfn_vm *vm;
+  struct kvm *kvm;
+  size_t off = 0;
+  gfn_t gfn, end;
+  u64 *words;
+  int rc, idx;
+
+  if (copy_from_user(&req, uarg, sizeof(req)))
+    return -EFAULT;
+  if ((req.flags & ~GFN_ACCESS_CLEAR_YOUNG) || req.reserved ||
+      !req.npages || req.npages > GFN_XLATE_RANGE_MAX)
+    return -EINVAL;
+
+  gfn = req.start_gfn >> PAGE_SHIFT;
+  end = gfn + req.npages;
+  if (end < gfn)
+    return -EINVAL;
+
+  as.cap = min_t(u64, req.npages, GFN_ACCESS_STAGE);
+  as.young = bitmap_zalloc(as.cap, GFP_KERNEL);
+  as.dirty = bitmap_zalloc(as.cap, GFP_KERNEL);
+  words = kmalloc_array(BITS_TO_U64(as.cap), sizeof(u64), GFP_KERNEL);
+  if (!as.young || !as.dirty || !words) {
+    rc = -ENOMEM;
+    goto out_free;
+  }
+
+  rc = gfn_ctx_enter(ctx, req.vm_pid, &vm, &kvm);
+  if (rc)
+    goto out_free;
+
+  /*
+   * Each stage covers a multiple of 64 pages, so every copy lands on a
+   * whole word of the user bitmaps.
+   */
+  while (gfn < end) {
+    as.n = 0;
+    bitmap_zero(as.young, as.cap);
+    bitmap_zero(as.dirty, as.cap);
+
+    idx = srcu_read_lock(&kvm->srcu);
+    mmap_read_lock(kvm->mm);
+    gfn = gfn_xlate_access(kvm, gfn, end,
+                           req.flags & GFN_ACCESS_CLEAR_YOUNG, &as);
+    mmap_read_unlock(kvm->mm);
+    srcu_read_unlock(&kvm->srcu, idx);
+
+    rc = gfn_access_copy(req.young, words, as.young, as.n, off);
+    if (!rc)
+      rc = gfn_access_copy(req.dirty, words, as.dirty, as.n, off);
+    if (rc)
+      break;
+    off += BITS_TO_U64(as.n) * sizeof(u64);
+
+    if (fatal_signal_pending(current)) {
+      rc = -EINTR;
+      break;
+    }
+  }
+
+  gfn_ctx_leave(vm, kvm);
 
-  return simple_read_from_buffer(ubuf, len, ppos, ctx->reply, ctx->reply_len);
+  if (!rc) {
+    req.nr_present = as.nr_present;
+    req.nr_young = as.nr_young;
+    req.nr_dirty = as.nr_dirty;
+    if (copy_to_user(uarg, &req, sizeof(req)))
+      rc = -EFAULT;
+  }
+
+out_free:
+  kfree(words);
+  bitmap_free(as.dirty);
+  bitmap_free(as.young);
+  return rc;
+}
+
+/* --- reverse PFN lookup --- */
+static u32 gfn_rmap_vm(struct gfn_vm *vm, struct gfn_rmap_result *res,
+                       u32 count) {
+  struct kvm *kvm = gfn_vm_pin(vm);
+  u32 left;
+
+  if (!kvm)
+    return count;
+  left = gfn_rmap_lookup(vm, kvm, res, count);
+  gfn_vm_unpin(kvm);
+  return left;
+}
+
+static long gfn_ioctl_rmap_batch(struct gfn_rmap_batch __user *uarg) {
+  struct gfn_rmap_batch batch;
+  struct gfn_rmap_result *res;
+  struct gfn_vm *vm;
+  unsigned long pid = 0;
+  u32 i, left;
+  int rc = 0;
+
+  if (copy_from_user(&batch, uarg, sizeof(batch)))
+    return -EFAULT;
+  if (batch.flags || !batch.count || batch.count > GFN_XLATE_BATCH_MAX)
+    return -EINVAL;
+
+  res = vmemdup_user(u64_to_user_ptr(batch.results),
+                     array_size(batch.count, sizeof(*res)));
+  if (IS_ERR(res))
+    return PTR_ERR(res);
+
+  for (i = 0; i < batch.count; i++) {
+    res[i].vm_pid = 0;
+    res[i].gpa = 0;
+    res[i].kind = GFN_KIND_NONE;
+    res[i].error = -ENOENT;
+  }
+
+  if (batch.vm_pid) {
+    vm = gfn_vm_lookup(true, batch.vm_pid);
+    if (IS_ERR(vm)) {
+      rc = PTR_ERR(vm);
+      goto out_free;
+    }
+    gfn_rmap_vm(vm, res, batch.count);
+    gfn_vm_put(vm);
+  } else {
+    /* Every VM on the host, including those nobody has named yet. */
+    gfn_vm_sync();
+    left = batch.count;
+    while (left && (vm = gfn_vm_next(&pid))) {
+      left = gfn_rmap_vm(vm, res, batch.count);
+      gfn_vm_put(vm);
+    }
+  }
+
+  if (copy_to_user(u64_to_user_ptr(batch.results), res,
+                   array_size(batch.count, sizeof(*res))))
+    rc = -EFAULT;
+
+out_free:
+  kvfree(res);
+  return rc;
+}
+
+/* --- bind the fd to one VM; pid 0 drops the binding --- */
+static long gfn_ioctl_bind_vm(struct gfn_ctx *ctx, __u64 __user *uarg) {
+  struct gfn_vm *vm = NULL, *old;
+  __u64 vm_pid;
+
+  if (get_user(vm_pid, uarg))
+    return -EFAULT;
+
+  if (vm_pid) {
+    vm = gfn_vm_lookup(true, vm_pid);
+    if (IS_ERR(vm))
+      return PTR_ERR(vm);
+  }
+
+  spin_lock(&ctx->lock);
+  old = ctx->vm;
+  ctx->vm = vm;
+  spin_unlock(&ctx->lock);
+
+  gfn_vm_put(old);
+  return 0;
+}
+
+/* --- reply format; switching to CSV queues its header row --- */
+static long gfn_ioctl_format(struct gfn_ctx *ctx, __u32 __user *uarg) {
+  struct gfn_reply *r = NULL;
+  __u32 fmt;
+
+  if (get_user(fmt, uarg))
+    return -EFAULT;
+  if (fmt >= GFN_FORMAT_NR)
+    return -EINVAL;
+
+  if (fmt == GFN_FORMAT_CSV && READ_ONCE(ctx->format) != fmt) {
+    r = kmalloc(sizeof(*r), GFP_KERNEL);
+    if (!r)
+      return -ENOMEM;
+    r->len = gfn_format_header(r->buf, REPLY_MAX, fmt);
+  }
+
+  /* Under the write lock, so no text reply lands between the two. */
+  mutex_lock(&ctx->write_lock);
+  WRITE_ONCE(ctx->format, fmt);
+  if (r)
+    gfn_ctx_queue(ctx, r);
+  mutex_unlock(&ctx->write_lock);
+  return 0;
+}
+
+/* --- invalidation watches --- */
+static long gfn_ioctl_watch(struct gfn_ctx *ctx,
+                            struct gfn_watch_req __user *uarg) {
+  struct gfn_watch_req req;
+  struct gfn_vm *vm;
+  struct kvm *kvm;
+  gfn_t gfn;
+  int rc;
+
+  if (copy_from_user(&req, uarg, sizeof(req)))
+    return -EFAULT;
+  gfn = req.start_gfn >> PAGE_SHIFT;
+  if (!req.npages || gfn + req.npages < gfn)
+    return -EINVAL;
+
+  rc = gfn_ctx_enter(ctx, req.vm_pid, &vm, &kvm);
+  if (rc)
+    return rc;
+  rc = gfn_watch_add(&ctx->watcher, vm, kvm, gfn, req.npages, req.cookie);
+  gfn_ctx_leave(vm, kvm);
+  return rc;
+}
+
+static long gfn_ioctl_unwatch(struct gfn_ctx *ctx, __u64 __user *uarg) {
+  __u64 cookie;
+
+  if (get_user(cookie, uarg))
+    return -EFAULT;
+  return gfn_watch_del(&ctx->watcher, cookie);
+}
+
+/* --- ranges changed since a generation --- */
+static long gfn_ioctl_changes(struct gfn_ctx *ctx,
+                              struct gfn_change_query __user *uarg) {
+  struct gfn_change_query q;
+  struct gfn_change *out;
+  struct gfn_vm *vm;
+  struct kvm *kvm;
+  int rc;
+
+  if (copy_from_user(&q, uarg, sizeof(q)))
+    return -EFAULT;
+  if (q.reserved || !q.max_ranges || q.max_ranges > GFN_XLATE_BATCH_MAX)
+    return -EINVAL;
+
+  out = kvmalloc_array(q.max_ranges, sizeof(*out), GFP_KERNEL);
+  if (!out)
+    return -ENOMEM;
+
+  rc = gfn_ctx_enter(ctx, q.vm_pid, &vm, &kvm);
+  if (rc)
+    goto out_free;
+  rc = gfn_chlog_query(vm, kvm, &q, out);
+  gfn_ctx_leave(vm, kvm);
+  if (rc)
+    goto out_free;
+
+  if (copy_to_user(u64_to_user_ptr(q.ranges), out,
+                   array_size(q.count, sizeof(*out))) ||
+      copy_to_user(uarg, &q, sizeof(q)))
+    rc = -EFAULT;
+
+out_free:
+  kvfree(out);
+  return rc;
+}
+
+static long gfn_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+  struct gfn_ctx *ctx = file->private_data;
+  void __user *uarg = (void __user *)arg;
+
+  switch (cmd) {
+  case GFN_IOC_XLATE_BATCH:
+    return gfn_ioctl_xlate_batch(ctx, uarg);
+  case GFN_IOC_XLATE_RANGE:
+    return gfn_ioctl_xlate_range(ctx, uarg);
+  case GFN_IOC_XLATE_EXTENTS:
+    return gfn_ioctl_xlate_extents(ctx, uarg);
+  case GFN_IOC_RING_SETUP:
+    return gfn_ioctl_ring_setup(ctx, uarg);
+  case GFN_IOC_RING_ENTER:
+    return gfn_ioctl_ring_enter(ctx);
+  case GFN_IOC_BIND_VM:
+    return gfn_ioctl_bind_vm(ctx, uarg);
+  case GFN_IOC_RMAP_BATCH:
+    return gfn_ioctl_rmap_batch(uarg);
+  case GFN_IOC_ACCESS_BITS:
+    return gfn_ioctl_access_bits(ctx, uarg);
+  case GFN_IOC_WATCH:
+    return gfn_ioctl_watch(ctx, uarg);
+  case GFN_IOC_UNWATCH:
+    return gfn_ioctl_unwatch(ctx, uarg);
+  case GFN_IOC_CHANGES:
+    return gfn_ioctl_changes(ctx, uarg);
+  case GFN_IOC_FORMAT:
+    return gfn_ioctl_format(ctx, uarg);
+  case GFN_IOC_GVA_XLATE:
+    return gfn_ioctl_gva_xlate(ctx, uarg);
+  case GFN_IOC_CONTIG:
+    return gfn_ioctl_contig(ctx, uarg);
+  default:
+    return -ENOTTY;
+  }
 }
 
 static __poll_t gfn_poll(struct file *file, poll_table *pt) {
   struct gfn_ctx *ctx = file->private_data;
+  struct gfn_ring *ring = smp_load_acquire(&ctx->ring);
   __poll_t m = 0;
 
   poll_wait(file, &ctx->wq, pt);
-  if (ctx->reply_ready)
+  if (gfn_ctx_has_reply(ctx) || (ring && gfn_ring_cq_ready(ring)))
     m |= POLLIN | POLLRDNORM;
+  if (gfn_ctx_has_room(ctx))
+    m |= POLLOUT | POLLWRNORM;
   return m;
 }
 
+static int gfn_mmap(struct file *file, struct vm_area_struct *vma) {
+  struct gfn_ctx *ctx = file->private_data;
+  struct gfn_ring *ring = smp_load_acquire(&ctx->ring);
+
+  if (!ring)
+    return -ENXIO;
+  return gfn_ring_mmap(ring, vma);
+}
+
 static const struct proc_ops gfn_fops = {
     .proc_open = gfn_open,
     .proc_release = gfn_release,
     .proc_read = gfn_read,
     .proc_write = gfn_write,
     .proc_poll = gfn_poll,
+    .proc_mmap = gfn_mmap,
+    .proc_ioctl = gfn_ioctl,
+#ifdef CONFIG_COMPAT
+    .proc_compat_ioctl = compat_ptr_ioctl,
+#endif
 };
 
 static int __init gfn_module_init(void) {
+  int rc;
+
+  rc = gfn_stats_init();
+  if (rc)
+    return rc;
+
+  rc = gfn_map_init();
+  if (rc)
+    goto err_stats;
+
+  rc = gfn_vm_init();
+  if (rc)
+    goto err_map;
+
+  rc = gfn_ring_init();
+  if (rc)
+    goto err_vm;
+
+  rc = gfn_scan_init();
+  if (rc)
+    goto err_ring;
+
+  rc = gfn_comp_init();
+  if (rc)
+    goto err_scan;
+
   proc_entry = proc_create(PROC_NAME, 0640, NULL, &gfn_fops);
-  if (!proc_entry)
-    return -ENOMEM;
+  if (!proc_entry) {
+    rc = -ENOMEM;
+    goto err_comp;
+  }
   pr_info("gfn_to_pfn loaded\n");
   return 0;
+
+err_comp:
+  gfn_comp_exit();
+err_scan:
+  gfn_scan_exit();
+err_ring:
+  gfn_ring_exit();
+err_vm:
+  gfn_vm_exit();
+err_map:
+  gfn_map_exit();
+err_stats:
+  gfn_stats_exit();
+  return rc;
 }
 
 static void __exit gfn_module_exit(void) {
   proc_remove(proc_entry);
+  gfn_comp_exit();
+  gfn_scan_exit();
+  gfn_ring_exit();
+  gfn_vm_exit();
+  gfn_map_exit();
+  gfn_stats_exit();
   pr_info("gfn_to_pfn unloaded\n");
 }
 
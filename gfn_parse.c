@@ -1,97 +1,232 @@
-#ifndef __KERNEL__
-#define _GNU_SOURCE
-#endif
-
 #include "gfn_parse.h"
 
 #ifdef __KERNEL__
-#include <linux/ctype.h>
 #include <linux/errno.h>
 #include <linux/kernel.h>
+#include <linux/limits.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
 #include <linux/string.h>
+#define gfn_parse_alloc(n, size) kvmalloc_array(n, size, GFP_KERNEL)
+#define gfn_parse_free(p) kvfree(p)
 #else
-#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#define gfn_parse_alloc(n, size) calloc(n, size)
+#define gfn_parse_free(p) free(p)
 #endif
 
-#ifndef __KERNEL__
-static int parse_ulong_token(const char *token, unsigned long *value) {
-  char *end = NULL;
-  unsigned long parsed;
+#define PID_PREFIX "pid="
+#define TAG_PREFIX "tag="
+#define PREFIX_LEN (sizeof(TAG_PREFIX) - 1)
 
-  if (!token || !value)
-    return -EINVAL;
+/*
+ * Parse len bytes as an unsigned long with strtoul() base 0 rules: 0x for
+ * hex, a leading 0 for octal, decimal otherwise. The token is already
+ * delimited, so there is no terminator to look for and no locale.
+ */
+static int parse_ulong(const char *p, size_t len, unsigned long *value) {
+  unsigned long v = 0, base = 10, d;
+  size_t i = 0;
 
-  errno = 0;
-  parsed = strtoul(token, &end, 0);
-  if (errno)
-    return -errno;
-  if (end == token || (end && *end))
+  if (!len)
     return -EINVAL;
+  if (p[0] == '0' && len > 1) {
+    if ((p[1] | 0x20) == 'x') {
+      base = 16;
+      i = 2;
+      if (len == 2)
+        return -EINVAL;
+    } else {
+      base = 8;
+      i = 1;
+    }
+  }
 
-  *value = parsed;
+  for (; i < len; i++) {
+    unsigned char c = p[i];
+
+    if (c >= '0' && c <= '9')
+      d = c - '0';
+    else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+      d = (c | 0x20) - 'a' + 10;
+    else
+      return -EINVAL;
+    if (d >= base)
+      return -EINVAL;
+    if (v > (ULONG_MAX - d) / base)
+      return -ERANGE;
+    v = v * base + d;
+  }
+
+  *value = v;
   return 0;
 }
-#else
-static int parse_ulong_token(const char *token, unsigned long *value) {
-  if (!token || !value)
-    return -EINVAL;
-  return kstrtoul(token, 0, value);
+
+static bool has_prefix(const char *tok, size_t len, const char *prefix) {
+  return len >= PREFIX_LEN && !memcmp(tok, prefix, PREFIX_LEN);
 }
-#endif
 
-static bool token_has_content(const char *token) {
-  return token && *token;
+static void stream_reset_line(struct gfn_stream *s) {
+  s->nr = 0;
+  s->vm_pid = 0;
+  s->tag = 0;
+  s->has_pid = false;
+  s->has_tag = false;
+  s->pid_key = false;
+  s->partial = false;
+  s->tokens = false;
+  s->error = 0;
 }
 
-static char *next_token(char **cursor) {
-  return strsep(cursor, " \t\n");
+void gfn_stream_init(struct gfn_stream *s) {
+  memset(s, 0, sizeof(*s));
 }
 
-int gfn_parse_request(char *buffer, struct gfn_request *req) {
-  char *cursor;
-  char *token;
-  bool have_gfn = false;
-  bool have_pid = false;
+void gfn_stream_destroy(struct gfn_stream *s) {
+  gfn_parse_free(s->gfns);
+  s->gfns = NULL;
+}
+
+static int stream_emit(struct gfn_stream *s, gfn_line_fn fn, void *arg) {
+  struct gfn_line line = {
+      .gfns = s->gfns,
+      .nr = s->error ? 0 : s->nr,
+      .vm_pid = s->vm_pid,
+      .tag = s->tag,
+      .has_pid = s->has_pid,
+      .has_tag = s->has_tag,
+      .error = s->error,
+  };
+
+  return fn(arg, &line);
+}
+
+/* Classify the token in s->tok and fold it into the current line. */
+static int stream_token(struct gfn_stream *s, gfn_line_fn fn, void *arg) {
+  const char *tok = s->tok;
+  size_t len = s->tok_len;
+  unsigned long v;
   int rc;
 
-  if (!buffer || !req)
-    return -EINVAL;
+  s->tok_len = 0;
+  s->tokens = true;
+  if (s->tok_long) {
+    s->tok_long = false;
+    s->error = -EINVAL;
+  }
+  if (s->error)
+    return 0;
+
+  if (has_prefix(tok, len, PID_PREFIX)) {
+    s->error = parse_ulong(tok + PREFIX_LEN, len - PREFIX_LEN, &s->vm_pid);
+    s->pid_key = true;
+    s->has_pid = s->vm_pid != 0; /* pid=0 names the default VM */
+    return 0;
+  }
+  if (has_prefix(tok, len, TAG_PREFIX)) {
+    rc = parse_ulong(tok + PREFIX_LEN, len - PREFIX_LEN, &v);
+    if (rc) {
+      s->error = rc;
+      return 0;
+    }
+    s->tag = v;
+    s->has_tag = true;
+    return 0;
+  }
 
-  req->raw_gfn = 0;
-  req->vm_pid = 0;
-  req->has_pid = false;
-  cursor = buffer;
+  rc = parse_ulong(tok, len, &v);
+  if (rc) {
+    s->error = rc;
+    return 0;
+  }
+  if (!s->gfns) {
+    s->gfns = gfn_parse_alloc(GFN_LINE_MAX, sizeof(*s->gfns));
+    if (!s->gfns)
+      return -ENOMEM;
+  }
+  if (s->nr == GFN_LINE_MAX) {
+    /* Keys that come later in the line do not reach this part. */
+    rc = stream_emit(s, fn, arg);
+    if (rc == -EAGAIN)
+      s->tok_len = len; /* hand this token over again on the retry */
+    if (rc)
+      return rc;
+    s->nr = 0;
+    s->partial = true;
+  }
+  s->gfns[s->nr++] = v;
+  return 0;
+}
 
-  while ((token = next_token(&cursor))) {
-    if (!token_has_content(token))
-      continue;
+/*
+ * The legacy "gfn pid" form: two bare numbers and no pid= key name a GFN
+ * and a VM. Otherwise every number is a GFN.
+ */
+static int stream_line(struct gfn_stream *s, gfn_line_fn fn, void *arg) {
+  int rc = 0;
+
+  if (!s->error && !s->pid_key && !s->partial && s->nr == 2) {
+    s->vm_pid = s->gfns[1];
+    s->has_pid = true;
+    s->nr = 1;
+  }
+  if (!s->error && !s->nr && !s->partial && s->tokens)
+    s->error = -EINVAL;
+
+  if (s->error || s->nr)
+    rc = stream_emit(s, fn, arg);
+  if (rc != -EAGAIN)
+    stream_reset_line(s);
+  return rc;
+}
 
-    if (!have_gfn) {
-      rc = parse_ulong_token(token, &req->raw_gfn);
+/*
+ * Feed len bytes of input. fn is called for every line completed (blank
+ * lines are skipped) and for every GFN_LINE_MAX GFNs of a longer line.
+ * Bytes after the last newline stay buffered for the next call. *used is
+ * set to the bytes consumed; 0 is returned once all of them are. If fn
+ * returns -EAGAIN, the line is kept and the byte that completed it is not
+ * consumed, so feeding again from buf + *used hands it over once more.
+ * Any other error from fn or from allocation drops the current line.
+ */
+int gfn_stream_feed(struct gfn_stream *s, const char *buf, size_t len,
+                    size_t *used, gfn_line_fn fn, void *arg) {
+  size_t i;
+  int rc = 0;
+
+  for (i = 0; i < len; i++) {
+    char c = buf[i];
+
+    if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+      if (s->tok_len || s->tok_long)
+        rc = stream_token(s, fn, arg);
+      if (!rc && c == '\n')
+        rc = stream_line(s, fn, arg);
       if (rc)
-        return rc;
-      have_gfn = true;
+        break;
       continue;
     }
 
-    if (!have_pid) {
-      rc = parse_ulong_token(token, &req->vm_pid);
-      if (rc)
-        return rc;
-      have_pid = true;
-      req->has_pid = true;
-      break;
-    }
-
-    break;
+    if (s->tok_len == GFN_TOKEN_MAX)
+      s->tok_long = true;
+    else
+      s->tok[s->tok_len++] = c;
   }
 
-  if (!have_gfn)
-    return -EINVAL;
-
+  if (rc == -EAGAIN) {
+    *used = i;
+    return rc;
+  }
+  if (rc) {
+    s->tok_len = 0;
+    s->tok_long = false;
+    stream_reset_line(s);
+    *used = i + 1;
+    return rc;
+  }
+  *used = len;
   return 0;
 }
-
@@ -8,12 +8,66 @@
 #include <stddef.h>
 #endif
 
+/* Longest token (a number or key=value) carried between writes. */
+#define GFN_TOKEN_MAX 32
+/* GFNs collected before a long line is handed over in parts. */
+#define GFN_LINE_MAX 4096
+
+/* One GFN of a line, with the keys that apply to it. */
 struct gfn_request {
   unsigned long raw_gfn;
   unsigned long vm_pid;
+  unsigned long tag;
+  bool has_pid;
+  bool has_tag;
+};
+
+/*
+ * A parsed line, or the first GFN_LINE_MAX GFNs of a longer one. On error
+ * the whole line is rejected and gfns is empty; tag is still set if the
+ * tag= token itself parsed.
+ */
+struct gfn_line {
+  const unsigned long *gfns;
+  size_t nr;
+  unsigned long vm_pid;
+  unsigned long tag;
+  bool has_pid;
+  bool has_tag;
+  int error;
+};
+
+/*
+ * Returns 0 to go on, -EAGAIN to stop and be handed the same line again on
+ * the next feed, or another negative errno that gfn_stream_feed() passes up.
+ */
+typedef int (*gfn_line_fn)(void *arg, const struct gfn_line *line);
+
+/*
+ * Incremental tokenizer state for one text stream. Input may be cut
+ * anywhere, including inside a token; a line is handed over when its
+ * newline arrives.
+ */
+struct gfn_stream {
+  char tok[GFN_TOKEN_MAX];
+  size_t tok_len;
+  bool tok_long;
+
+  unsigned long *gfns; /* GFN_LINE_MAX, allocated on first use */
+  size_t nr;
+  unsigned long vm_pid;
+  unsigned long tag;
   bool has_pid;
+  bool has_tag;
+  bool pid_key; /* pid= seen, so two numbers are two GFNs */
+  bool partial; /* part of this line has already been handed over */
+  bool tokens;  /* the line is not blank */
+  int error;
 };
 
-int gfn_parse_request(char *buffer, struct gfn_request *req);
+void gfn_stream_init(struct gfn_stream *s);
+void gfn_stream_destroy(struct gfn_stream *s);
+int gfn_stream_feed(struct gfn_stream *s, const char *buf, size_t len,
+                    size_t *used, gfn_line_fn fn, void *arg);
 
 #endif /* GFN_PARSE_H */
@@ -0,0 +1,189 @@
+// gfn_ring.c
+#include <linux/kvm_host.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mmap_lock.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "gfn_ring.h"
+#include "gfn_vm.h"
+#include "gfn_xlate.h"
+
+struct gfn_ring {
+  struct work_struct work;
+  wait_queue_head_t *wq; /* the owning fd's poll queue */
+  struct gfn_vm *vm;
+
+  /* Kernel-owned copies; the shared headers are only ever published to. */
+  u32 sq_head, sq_mask;
+  u32 cq_tail, cq_mask;
+
+  struct gfn_ring_hdr *sq_hdr;
+  struct gfn_ring_sqe *sqes;
+  size_t sq_size;
+
+  struct gfn_ring_hdr *cq_hdr;
+  struct gfn_ring_cqe *cqes;
+  size_t cq_size;
+};
+
+static struct workqueue_struct *gfn_ring_wq;
+
+static void *gfn_ring_alloc(u32 entries, size_t entry_size, size_t *size,
+                            struct gfn_ring_hdr **hdr) {
+  void *mem;
+
+  *size = PAGE_ALIGN(GFN_RING_ENTRIES_OFF + entries * entry_size);
+  mem = vmalloc_user(*size);
+  if (!mem)
+    return NULL;
+
+  *hdr = mem;
+  (*hdr)->mask = entries - 1;
+  (*hdr)->entries = entries;
+  return mem + GFN_RING_ENTRIES_OFF;
+}
+
+/*
+ * Drain the SQ into the CQ. Indices the other side writes are read with
+ * acquire, the ones we publish are written with release, and every SQE is
+ * copied before use since userspace may rewrite it at any time. Masks and
+ * our own indices come from the kernel copies so a corrupted header can
+ * only confuse the caller, never send us outside the rings.
+ */
+static void gfn_ring_work(struct work_struct *work) {
+  struct gfn_ring *ring = container_of(work, struct gfn_ring, work);
+  struct gfn_ring_hdr *sq = ring->sq_hdr, *cq = ring->cq_hdr;
+  u32 sq_head = ring->sq_head, cq_tail = ring->cq_tail;
+  u32 sq_tail = smp_load_acquire(&sq->tail);
+  u32 cq_head = smp_load_acquire(&cq->head);
+  struct kvm *kvm;
+  int rc = 0, idx = 0;
+
+  if (sq_head == sq_tail)
+    return;
+
+  kvm = gfn_vm_pin(ring->vm);
+  if (kvm) {
+    idx = srcu_read_lock(&kvm->srcu);
+    mmap_read_lock(kvm->mm);
+  } else {
+    rc = -ESRCH;
+  }
+
+  while (sq_head != sq_tail && cq_tail - cq_head <= ring->cq_mask) {
+    struct gfn_ring_sqe *sqe = &ring->sqes[sq_head & ring->sq_mask];
+    struct gfn_ring_cqe *cqe = &ring->cqes[cq_tail & ring->cq_mask];
+    struct gfn_xlate_req req = {
+        .gfn = READ_ONCE(sqe->gfn),
+        .flags = READ_ONCE(sqe->flags),
+        .reserved = READ_ONCE(sqe->reserved),
+    };
+
+    cqe->user_data = READ_ONCE(sqe->user_data);
+    if (rc) {
+      memset(&cqe->res, 0, sizeof(cqe->res));
+      cqe->res.gpa = req.gfn;
+      cqe->res.error = rc;
+    } else {
+      gfn_xlate_one(kvm, ring->vm, &req, &cqe->res);
+    }
+
+    sq_head++;
+    cq_tail++;
+    cond_resched();
+  }
+
+  if (kvm) {
+    mmap_read_unlock(kvm->mm);
+    srcu_read_unlock(&kvm->srcu, idx);
+    gfn_vm_unpin(kvm);
+  }
+
+  ring->sq_head = sq_head;
+  ring->cq_tail = cq_tail;
+  smp_store_release(&sq->head, sq_head);
+  smp_store_release(&cq->tail, cq_tail);
+  wake_up_interruptible(ring->wq);
+}
+
+struct gfn_ring *gfn_ring_create(const struct gfn_ring_setup *setup,
+                                 struct gfn_vm *vm, wait_queue_head_t *wq) {
+  struct gfn_ring *ring;
+
+  if (!is_power_of_2(setup->sq_entries) || !is_power_of_2(setup->cq_entries) ||
+      setup->sq_entries > GFN_RING_MAX_ENTRIES ||
+      setup->cq_entries > GFN_RING_MAX_ENTRIES)
+    return ERR_PTR(-EINVAL);
+
+  ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+  if (!ring)
+    return ERR_PTR(-ENOMEM);
+
+  INIT_WORK(&ring->work, gfn_ring_work);
+  ring->wq = wq;
+  ring->vm = vm;
+  ring->sq_mask = setup->sq_entries - 1;
+  ring->cq_mask = setup->cq_entries - 1;
+  ring->sqes = gfn_ring_alloc(setup->sq_entries, sizeof(*ring->sqes),
+                              &ring->sq_size, &ring->sq_hdr);
+  ring->cqes = gfn_ring_alloc(setup->cq_entries, sizeof(*ring->cqes),
+                              &ring->cq_size, &ring->cq_hdr);
+  if (!ring->sqes || !ring->cqes) {
+    ring->vm = NULL; /* still the caller's on failure */
+    gfn_ring_destroy(ring);
+    return ERR_PTR(-ENOMEM);
+  }
+  return ring;
+}
+
+void gfn_ring_destroy(struct gfn_ring *ring) {
+  if (!ring)
+    return;
+  cancel_work_sync(&ring->work);
+  gfn_vm_put(ring->vm);
+  vfree(ring->sq_hdr);
+  vfree(ring->cq_hdr);
+  kfree(ring);
+}
+
+int gfn_ring_mmap(struct gfn_ring *ring, struct vm_area_struct *vma) {
+  unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+  unsigned long len = vma->vm_end - vma->vm_start;
+  void *mem;
+  size_t size;
+
+  if (off == GFN_RING_OFF_SQ) {
+    mem = ring->sq_hdr;
+    size = ring->sq_size;
+  } else if (off == GFN_RING_OFF_CQ) {
+    mem = ring->cq_hdr;
+    size = ring->cq_size;
+  } else {
+    return -EINVAL;
+  }
+
+  if (len > size)
+    return -EINVAL;
+  return remap_vmalloc_range(vma, mem, 0);
+}
+
+/* Doorbell: schedule a drain of everything submitted so far. */
+void gfn_ring_kick(struct gfn_ring *ring) {
+  queue_work(gfn_ring_wq, &ring->work);
+}
+
+bool gfn_ring_cq_ready(struct gfn_ring *ring) {
+  return READ_ONCE(ring->cq_tail) != READ_ONCE(ring->cq_hdr->head);
+}
+
+int gfn_ring_init(void) {
+  gfn_ring_wq = alloc_workqueue("gfn_ring", WQ_UNBOUND, 0);
+  return gfn_ring_wq ? 0 : -ENOMEM;
+}
+
+void gfn_ring_exit(void) {
+  destroy_workqueue(gfn_ring_wq);
+}
@@ -0,0 +1,23 @@
+#ifndef GFN_RING_H
+#define GFN_RING_H
+
+#include <linux/mm_types.h>
+#include <linux/wait.h>
+
+#include "gfn_ioctl.h"
+
+struct gfn_ring;
+struct gfn_vm;
+
+/* Takes over the caller's reference on vm if it succeeds. */
+struct gfn_ring *gfn_ring_create(const struct gfn_ring_setup *setup,
+                                 struct gfn_vm *vm, wait_queue_head_t *wq);
+void gfn_ring_destroy(struct gfn_ring *ring);
+int gfn_ring_mmap(struct gfn_ring *ring, struct vm_area_struct *vma);
+void gfn_ring_kick(struct gfn_ring *ring);
+bool gfn_ring_cq_ready(struct gfn_ring *ring);
+
+int gfn_ring_init(void);
+void gfn_ring_exit(void);
+
+#endif /* GFN_RING_H */
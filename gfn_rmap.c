@@ -0,0 +1,167 @@
+// gfn_rmap.c
+#include <linux/kvm_host.h>
+#include <linux/mm.h>
+#include <linux/mmap_lock.h>
+#include <linux/slab.h>
+
+#include "gfn_rmap.h"
+#include "gfn_rmap_table.h"
+#include "gfn_vm.h"
+#include "gfn_xlate.h"
+
+/*
+ * PFN-sorted extent table for one VM. It is a snapshot: it records the
+ * memslot generation and the VM's move sequence it was built under, and
+ * is rebuilt by the first lookup after either changes. Write-protection
+ * and soft-dirty clearing do not count, so dirty logging and mprotect()
+ * do not force a rebuild.
+ */
+struct gfn_rmap {
+  struct gfn_rmap_table table;
+  u64 slots_gen;
+  u64 move_seq;
+};
+
+/* The memslot holding gfn, or else the next one above it; srcu held. */
+static struct kvm_memory_slot *gfn_rmap_next_slot(struct kvm *kvm,
+                                                  gfn_t gfn) {
+  struct kvm_memory_slot *slot, *next = NULL;
+  int bkt;
+
+  kvm_for_each_memslot(slot, bkt, kvm_memslots(kvm)) {
+    if (slot->base_gfn + slot->npages > gfn &&
+        (!next || slot->base_gfn < next->base_gfn))
+      next = slot;
+  }
+  return next;
+}
+
+/*
+ * Walk every memslot without faulting, collect the present extents and
+ * sort them by PFN. kvm->srcu and the mmap lock are held for at most
+ * GFN_RANGE_STAGE pages at a time, as in the extents ioctl, so memslot
+ * updates are not held off for the whole VM. If the memslot generation
+ * moves away from *gen between windows, the walk starts over; *gen is the
+ * generation the finished table matches.
+ */
+static int gfn_rmap_build(struct kvm *kvm, struct gfn_rmap *rm, u64 *gen) {
+  struct gfn_extent_sink es = {.cap = GFN_EXTENT_STAGE};
+  struct kvm_memory_slot *slot;
+  gfn_t gfn = 0, stop;
+  int idx, rc = 0;
+  size_t i;
+
+  es.out = kvmalloc_array(es.cap, sizeof(*es.out), GFP_KERNEL);
+  if (!es.out)
+    return -ENOMEM;
+
+  rm->table.nr = 0;
+  for (;;) {
+    idx = srcu_read_lock(&kvm->srcu);
+    if (kvm_memslots(kvm)->generation != *gen) {
+      *gen = kvm_memslots(kvm)->generation;
+      rm->table.nr = 0;
+      gfn = 0;
+    }
+    slot = gfn_rmap_next_slot(kvm, gfn);
+    if (!slot) {
+      srcu_read_unlock(&kvm->srcu, idx);
+      break;
+    }
+    gfn = max_t(gfn_t, gfn, slot->base_gfn);
+    stop = min_t(gfn_t, slot->base_gfn + slot->npages,
+                 gfn + GFN_RANGE_STAGE);
+
+    es.n = 0;
+    mmap_read_lock(kvm->mm);
+    gfn = gfn_xlate_extents(kvm, gfn, stop, GFN_XLATE_NOFAULT, &es);
+    mmap_read_unlock(kvm->mm);
+    srcu_read_unlock(&kvm->srcu, idx);
+
+    for (i = 0; i < es.n && !rc; i++) {
+      const struct gfn_extent *e = &es.out[i];
+
+      if (!e->error)
+        rc = gfn_rmap_table_add(&rm->table, e->hpa_start >> PAGE_SHIFT,
+                                e->gpa_start >> PAGE_SHIFT,
+                                e->length >> PAGE_SHIFT, e->kind);
+    }
+    if (rc)
+      goto out;
+    if (fatal_signal_pending(current)) {
+      rc = -EINTR;
+      goto out;
+    }
+  }
+
+  gfn_rmap_table_sort(&rm->table);
+out:
+  kvfree(es.out);
+  return rc;
+}
+
+/*
+ * Resolve every entry of res still marked -ENOENT against vm, rebuilding
+ * its table first if it is stale. Returns how many remain unresolved.
+ */
+u32 gfn_rmap_lookup(struct gfn_vm *vm, struct kvm *kvm,
+                    struct gfn_rmap_result *res, u32 count) {
+  struct gfn_rmap *rm;
+  u32 i, left = 0;
+  u64 gen, seq;
+  int idx, rc = 0;
+
+  mutex_lock(&vm->rmap_lock);
+  rm = vm->rmap;
+  if (!rm) {
+    rm = kzalloc(sizeof(*rm), GFP_KERNEL);
+    if (!rm) {
+      rc = -ENOMEM;
+      goto out;
+    }
+    rm->slots_gen = U64_MAX;
+    vm->rmap = rm;
+  }
+
+  idx = srcu_read_lock(&kvm->srcu);
+  gen = kvm_memslots(kvm)->generation;
+  srcu_read_unlock(&kvm->srcu, idx);
+  seq = gfn_vm_move_seq(vm);
+  if (rm->slots_gen != gen || rm->move_seq != seq) {
+    rc = gfn_rmap_build(kvm, rm, &gen);
+    /* A move that raced with the build leaves the table stale. */
+    rm->slots_gen = rc ? U64_MAX : gen;
+    rm->move_seq = seq;
+  }
+
+out:
+  for (i = 0; i < count; i++) {
+    const struct gfn_rmap_ext *e;
+
+    if (res[i].error != -ENOENT)
+      continue;
+    if (rc) {
+      res[i].error = rc;
+      continue;
+    }
+
+    e = gfn_rmap_table_find(&rm->table, res[i].pfn);
+    if (!e) {
+      left++;
+      continue;
+    }
+    res[i].vm_pid = vm->pid;
+    res[i].gpa = (e->gfn + (res[i].pfn - e->pfn)) << PAGE_SHIFT;
+    res[i].kind = e->kind;
+    res[i].error = 0;
+  }
+  mutex_unlock(&vm->rmap_lock);
+  return left;
+}
+
+void gfn_rmap_free(struct gfn_rmap *rm) {
+  if (!rm)
+    return;
+  gfn_rmap_table_free(&rm->table);
+  kfree(rm);
+}
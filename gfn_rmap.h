@@ -0,0 +1,15 @@
+#ifndef GFN_RMAP_H
+#define GFN_RMAP_H
+
+#include <linux/kvm_host.h>
+
+#include "gfn_ioctl.h"
+
+struct gfn_rmap;
+struct gfn_vm;
+
+u32 gfn_rmap_lookup(struct gfn_vm *vm, struct kvm *kvm,
+                    struct gfn_rmap_result *res, u32 count);
+void gfn_rmap_free(struct gfn_rmap *rm);
+
+#endif /* GFN_RMAP_H */
@@ -0,0 +1,119 @@
+#include "gfn_rmap_table.h"
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/minmax.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#define gfn_rmap_alloc(n, size) kvmalloc_array(n, size, GFP_KERNEL)
+#define gfn_rmap_release(p) kvfree(p)
+#define gfn_rmap_qsort(base, n, size, cmp) sort(base, n, size, cmp, NULL)
+#else
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#define gfn_rmap_alloc(n, size) calloc(n, size)
+#define gfn_rmap_release(p) free(p)
+#define gfn_rmap_qsort(base, n, size, cmp) qsort(base, n, size, cmp)
+#endif
+
+/* Append an extent, joining it to the last one when it continues it. */
+int gfn_rmap_table_add(struct gfn_rmap_table *t, __u64 pfn, __u64 gfn,
+                       __u64 npages, __u32 kind) {
+  struct gfn_rmap_ext *last = t->nr ? &t->ext[t->nr - 1] : NULL;
+
+  /* Runs split by the staging buffer join back up here. */
+  if (last && last->kind == kind && last->gfn + last->npages == gfn &&
+      last->pfn + last->npages == pfn) {
+    last->npages += npages;
+    return 0;
+  }
+
+  if (t->nr == t->cap) {
+    size_t cap = t->cap ? t->cap * 2 : 256;
+    struct gfn_rmap_ext *ext;
+    __u64 *max_end;
+
+    ext = gfn_rmap_alloc(cap, sizeof(*ext));
+    max_end = gfn_rmap_alloc(cap, sizeof(*max_end));
+    if (!ext || !max_end) {
+      gfn_rmap_release(ext);
+      gfn_rmap_release(max_end);
+      return -ENOMEM;
+    }
+    if (t->nr)
+      memcpy(ext, t->ext, t->nr * sizeof(*ext));
+    gfn_rmap_release(t->ext);
+    gfn_rmap_release(t->max_end);
+    t->ext = ext;
+    t->max_end = max_end;
+    t->cap = cap;
+  }
+
+  t->ext[t->nr++] = (struct gfn_rmap_ext){
+      .pfn = pfn,
+      .gfn = gfn,
+      .npages = npages,
+      .kind = kind,
+  };
+  return 0;
+}
+
+static int gfn_rmap_cmp(const void *a, const void *b) {
+  const struct gfn_rmap_ext *x = a, *y = b;
+
+  if (x->pfn != y->pfn)
+    return x->pfn < y->pfn ? -1 : 1;
+  return 0;
+}
+
+/* Sort by PFN and fill in max_end; call once all extents are added. */
+void gfn_rmap_table_sort(struct gfn_rmap_table *t) {
+  __u64 end = 0;
+  size_t i;
+
+  gfn_rmap_qsort(t->ext, t->nr, sizeof(*t->ext), gfn_rmap_cmp);
+  for (i = 0; i < t->nr; i++) {
+    if (t->ext[i].pfn + t->ext[i].npages > end)
+      end = t->ext[i].pfn + t->ext[i].npages;
+    t->max_end[i] = end;
+  }
+}
+
+/*
+ * An extent covering pfn, or NULL. The binary search finds the last
+ * extent starting at or below pfn; from there the search steps back for
+ * as long as some earlier extent still reaches past pfn. A PFN mapped at
+ * several GFNs (the zero page, KSM, aliased memslots) matches more than
+ * one extent; the one starting highest is reported.
+ */
+const struct gfn_rmap_ext *gfn_rmap_table_find(const struct gfn_rmap_table *t,
+                                               __u64 pfn) {
+  size_t lo = 0, hi = t->nr;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (t->ext[mid].pfn <= pfn)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo && t->max_end[lo - 1] > pfn; lo--) {
+    if (pfn < t->ext[lo - 1].pfn + t->ext[lo - 1].npages)
+      return &t->ext[lo - 1];
+  }
+  return NULL;
+}
+
+void gfn_rmap_table_free(struct gfn_rmap_table *t) {
+  gfn_rmap_release(t->ext);
+  gfn_rmap_release(t->max_end);
+  t->ext = NULL;
+  t->max_end = NULL;
+  t->nr = 0;
+  t->cap = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef GFN_RMAP_TABLE_H
+#define GFN_RMAP_TABLE_H
+
+#include <linux/types.h>
+#ifndef __KERNEL__
+#include <stddef.h>
+#endif
+
+/* pfn + i backs gfn + i for i < npages. */
+struct gfn_rmap_ext {
+  __u64 pfn;
+  __u64 gfn;
+  __u64 npages;
+  __u32 kind;
+};
+
+/*
+ * Extents sorted by PFN. Extents may overlap: QEMU aliases guest RAM into
+ * several memslots and KSM shares pages, so a short extent can start
+ * inside a long one. max_end[i] is the highest pfn + npages among the
+ * first i + 1 extents, which bounds how far back a lookup has to look.
+ */
+struct gfn_rmap_table {
+  struct gfn_rmap_ext *ext;
+  __u64 *max_end;
+  size_t nr, cap;
+};
+
+int gfn_rmap_table_add(struct gfn_rmap_table *t, __u64 pfn, __u64 gfn,
+                       __u64 npages, __u32 kind);
+void gfn_rmap_table_sort(struct gfn_rmap_table *t);
+const struct gfn_rmap_ext *gfn_rmap_table_find(const struct gfn_rmap_table *t,
+                                               __u64 pfn);
+void gfn_rmap_table_free(struct gfn_rmap_table *t);
+
+#endif /* GFN_RMAP_TABLE_H */
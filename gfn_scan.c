@@ -0,0 +1,130 @@
+// gfn_scan.c
+#include <linux/mm.h>
+#include <linux/mmap_lock.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "gfn_scan.h"
+#include "gfn_xlate.h"
+
+static unsigned int scan_workers = 4;
+static struct workqueue_struct *gfn_scan_wq;
+
+static int gfn_scan_workers_set(const char *val,
+                                const struct kernel_param *kp) {
+  unsigned int n;
+  int rc;
+
+  rc = kstrtouint(val, 0, &n);
+  if (rc)
+    return rc;
+  if (!n || n > WQ_MAX_ACTIVE)
+    return -EINVAL;
+
+  scan_workers = n;
+  if (gfn_scan_wq)
+    workqueue_set_max_active(gfn_scan_wq, n);
+  return 0;
+}
+
+static const struct kernel_param_ops gfn_scan_workers_ops = {
+    .set = gfn_scan_workers_set,
+    .get = param_get_uint,
+};
+module_param_cb(scan_workers, &gfn_scan_workers_ops, &scan_workers, 0644);
+MODULE_PARM_DESC(scan_workers,
+                 "Max concurrent workers for range and map scans (default: 4)");
+
+struct gfn_scan_chunk {
+  struct work_struct work;
+  struct kvm *kvm;
+  gfn_t gfn, end;
+  u32 flags;
+  enum gfn_scan_out type;
+  void *out;
+};
+
+static size_t gfn_scan_elem_size(enum gfn_scan_out type) {
+  return type == GFN_SCAN_RESULTS ? sizeof(struct gfn_xlate_result)
+                                  : sizeof(u64);
+}
+
+/* One lock hold over [gfn, end); out has room for every page in it. */
+static void gfn_scan_span(struct kvm *kvm, gfn_t gfn, gfn_t end, u32 flags,
+                          enum gfn_scan_out type, void *out) {
+  int idx;
+
+  idx = srcu_read_lock(&kvm->srcu);
+  mmap_read_lock(kvm->mm);
+  if (type == GFN_SCAN_RESULTS)
+    gfn_xlate_range(kvm, &gfn, end, flags, out, end - gfn);
+  else
+    gfn_xlate_records(kvm, &gfn, end, flags, out, end - gfn);
+  mmap_read_unlock(kvm->mm);
+  srcu_read_unlock(&kvm->srcu, idx);
+}
+
+static void gfn_scan_work(struct work_struct *work) {
+  struct gfn_scan_chunk *c = container_of(work, struct gfn_scan_chunk, work);
+
+  gfn_scan_span(c->kvm, c->gfn, c->end, c->flags, c->type, c->out);
+}
+
+/*
+ * Translate [gfn, end) into out, one element per page. Spans longer than
+ * a chunk are cut into GFN_SCAN_CHUNK windows, which run concurrently on
+ * the scan workqueue (up to scan_workers at once) and each write their own
+ * slice of out, so the result needs no merging. The windows are plain GFN
+ * ranges; gfn_walk_range() handles any memslot boundaries inside them.
+ *
+ * The caller keeps kvm pinned and must not hold kvm->srcu or the mmap
+ * lock: the workers take the mmap lock themselves, and waiting on them
+ * while holding it could deadlock behind a queued writer.
+ */
+void gfn_scan(struct kvm *kvm, gfn_t gfn, gfn_t end, u32 flags,
+              enum gfn_scan_out type, void *out) {
+  size_t elem = gfn_scan_elem_size(type);
+  unsigned long i, nr = DIV_ROUND_UP(end - gfn, GFN_SCAN_CHUNK);
+  struct gfn_scan_chunk *chunks = NULL;
+
+  if (nr > 1 && READ_ONCE(scan_workers) > 1)
+    chunks = kvcalloc(nr, sizeof(*chunks), GFP_KERNEL);
+  if (!chunks) {
+    gfn_scan_span(kvm, gfn, end, flags, type, out);
+    return;
+  }
+
+  for (i = 0; i < nr; i++) {
+    struct gfn_scan_chunk *c = &chunks[i];
+
+    INIT_WORK(&c->work, gfn_scan_work);
+    c->kvm = kvm;
+    c->gfn = gfn + i * GFN_SCAN_CHUNK;
+    c->end = min_t(gfn_t, c->gfn + GFN_SCAN_CHUNK, end);
+    c->flags = flags;
+    c->type = type;
+    c->out = out + i * GFN_SCAN_CHUNK * elem;
+    queue_work(gfn_scan_wq, &c->work);
+  }
+
+  for (i = 0; i < nr; i++)
+    flush_work(&chunks[i].work);
+  kvfree(chunks);
+}
+
+int gfn_scan_init(void) {
+  gfn_scan_wq = alloc_workqueue("gfn_scan", WQ_UNBOUND, scan_workers);
+  return gfn_scan_wq ? 0 : -ENOMEM;
+}
+
+void gfn_scan_exit(void) {
+  struct workqueue_struct *wq = gfn_scan_wq;
+
+  /* The parameter stays writable until the module is gone. */
+  kernel_param_lock(THIS_MODULE);
+  gfn_scan_wq = NULL;
+  kernel_param_unlock(THIS_MODULE);
+  destroy_workqueue(wq);
+}
@@ -0,0 +1,21 @@
+#ifndef GFN_SCAN_H
+#define GFN_SCAN_H
+
+#include <linux/kvm_host.h>
+
+/* Pages per work item when a span is split across the scan workqueue. */
+#define GFN_SCAN_CHUNK 4096
+
+/* What gfn_scan() writes for each page. */
+enum gfn_scan_out {
+  GFN_SCAN_RESULTS, /* struct gfn_xlate_result */
+  GFN_SCAN_RECORDS, /* gfn_to_pfn_map u64 records */
+};
+
+void gfn_scan(struct kvm *kvm, gfn_t gfn, gfn_t end, u32 flags,
+              enum gfn_scan_out type, void *out);
+
+int gfn_scan_init(void);
+void gfn_scan_exit(void);
+
+#endif /* GFN_SCAN_H */
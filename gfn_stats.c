@@ -0,0 +1,114 @@
+// gfn_stats.c
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "gfn_stats.h"
+#include "gfn_xlate.h"
+
+#define STATS_PROC_NAME "gfn_to_pfn_stats"
+
+DEFINE_PER_CPU(struct gfn_stats_cpu, gfn_stats);
+
+static struct proc_dir_entry *stats_proc;
+
+static const char *const gfn_stat_names[GFN_STAT_KIND] = {
+    [GFN_STAT_REQUESTS] = "requests",
+    [GFN_STAT_OK] = "ok",
+    [GFN_STAT_ERR_INPUT] = "err_invalid_input",
+    [GFN_STAT_ERR_NO_VM] = "err_no_vm",
+    [GFN_STAT_ERR_NO_VMS] = "err_no_vms",
+    [GFN_STAT_ERR_HVA] = "err_hva",
+    [GFN_STAT_ERR_GUP] = "err_gup",
+};
+
+static const char *const gfn_phase_names[GFN_PHASE_NR] = {
+    [GFN_PHASE_PARSE] = "parse",
+    [GFN_PHASE_VM] = "vm_lookup",
+    [GFN_PHASE_HVA] = "hva",
+    [GFN_PHASE_XLATE] = "gup",
+    [GFN_PHASE_FORMAT] = "format",
+};
+
+/*
+ * Sum every CPU's slot. Readers race with updates on other CPUs, so a
+ * snapshot can be a few events off; that is fine for monitoring.
+ */
+static int gfn_stats_show(struct seq_file *m, void *v) {
+  struct gfn_stats_cpu *sum;
+  int cpu, i, p, b;
+
+  sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+  if (!sum)
+    return -ENOMEM;
+
+  for_each_possible_cpu(cpu) {
+    const struct gfn_stats_cpu *s = per_cpu_ptr(&gfn_stats, cpu);
+
+    for (i = 0; i < GFN_STAT_NR; i++)
+      sum->count[i] += READ_ONCE(s->count[i]);
+    for (p = 0; p < GFN_PHASE_NR; p++) {
+      sum->sum_ns[p] += READ_ONCE(s->sum_ns[p]);
+      for (b = 0; b < GFN_HIST_BUCKETS; b++)
+        sum->hist[p][b] += READ_ONCE(s->hist[p][b]);
+    }
+  }
+
+  for (i = 0; i < GFN_STAT_KIND; i++)
+    seq_printf(m, "%s %llu\n", gfn_stat_names[i], sum->count[i]);
+  for (i = GFN_KIND_NONE; i <= GFN_KIND_HUGETLB; i++)
+    seq_printf(m, "kind_%s %llu\n", gfn_kind_names[i],
+               sum->count[GFN_STAT_KIND + i]);
+
+  /* One line per phase; "N:count" pairs give each bucket's upper bound. */
+  for (p = 0; p < GFN_PHASE_NR; p++) {
+    u64 n = 0;
+
+    for (b = 0; b < GFN_HIST_BUCKETS; b++)
+      n += sum->hist[p][b];
+    seq_printf(m, "phase=%s count=%llu avg_ns=%llu", gfn_phase_names[p], n,
+               n ? div64_u64(sum->sum_ns[p], n) : 0);
+    for (b = 0; b < GFN_HIST_BUCKETS; b++) {
+      if (sum->hist[p][b])
+        seq_printf(m, " %llu:%llu", 1ULL << b, sum->hist[p][b]);
+    }
+    seq_putc(m, '\n');
+  }
+
+  kfree(sum);
+  return 0;
+}
+
+static int gfn_stats_open(struct inode *inode, struct file *file) {
+  return single_open(file, gfn_stats_show, NULL);
+}
+
+/* Any write resets every counter and histogram. */
+static ssize_t gfn_stats_write(struct file *file, const char __user *ubuf,
+                               size_t count, loff_t *ppos) {
+  int cpu;
+
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(&gfn_stats, cpu), 0, sizeof(struct gfn_stats_cpu));
+  return count;
+}
+
+static const struct proc_ops gfn_stats_fops = {
+    .proc_open = gfn_stats_open,
+    .proc_read = seq_read,
+    .proc_write = gfn_stats_write,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
+
+int gfn_stats_init(void) {
+  stats_proc = proc_create(STATS_PROC_NAME, 0644, NULL, &gfn_stats_fops);
+  return stats_proc ? 0 : -ENOMEM;
+}
+
+void gfn_stats_exit(void) {
+  proc_remove(stats_proc);
+}
@@ -0,0 +1,67 @@
+#ifndef GFN_STATS_H
+#define GFN_STATS_H
+
+#include <linux/bitops.h>
+#include <linux/minmax.h>
+#include <linux/percpu.h>
+#include <linux/sched/clock.h>
+
+#include "gfn_ioctl.h"
+
+/* Text request outcomes and page kinds, counted per CPU. */
+enum gfn_stat {
+  GFN_STAT_REQUESTS,
+  GFN_STAT_OK,
+  GFN_STAT_ERR_INPUT,
+  GFN_STAT_ERR_NO_VM,
+  GFN_STAT_ERR_NO_VMS,
+  GFN_STAT_ERR_HVA,
+  GFN_STAT_ERR_GUP,
+  GFN_STAT_KIND, /* + enum gfn_page_kind */
+  GFN_STAT_NR = GFN_STAT_KIND + GFN_KIND_HUGETLB + 1,
+};
+
+/* Phases of gfn_write() with a latency histogram each. */
+enum gfn_phase {
+  GFN_PHASE_PARSE,
+  GFN_PHASE_VM,
+  GFN_PHASE_HVA,
+  GFN_PHASE_XLATE,
+  GFN_PHASE_FORMAT,
+  GFN_PHASE_NR,
+};
+
+/* Bucket b counts durations in [2^(b-1), 2^b) ns; the last one is open. */
+#define GFN_HIST_BUCKETS 32
+
+struct gfn_stats_cpu {
+  u64 count[GFN_STAT_NR];
+  u64 hist[GFN_PHASE_NR][GFN_HIST_BUCKETS];
+  u64 sum_ns[GFN_PHASE_NR];
+};
+
+DECLARE_PER_CPU(struct gfn_stats_cpu, gfn_stats);
+
+static inline void gfn_stat_inc(enum gfn_stat stat) {
+  this_cpu_inc(gfn_stats.count[stat]);
+}
+
+static inline u64 gfn_stat_start(void) {
+  return local_clock();
+}
+
+/* Account the time since start to phase; returns now for chaining. */
+static inline u64 gfn_stat_phase(enum gfn_phase phase, u64 start) {
+  u64 now = local_clock();
+  u64 delta = now - start;
+  unsigned int b = min_t(unsigned int, fls64(delta), GFN_HIST_BUCKETS - 1);
+
+  this_cpu_inc(gfn_stats.hist[phase][b]);
+  this_cpu_add(gfn_stats.sum_ns[phase], delta);
+  return now;
+}
+
+int gfn_stats_init(void);
+void gfn_stats_exit(void);
+
+#endif /* GFN_STATS_H */
@@ -19,7 +19,7 @@ int main(int argc, char *argv[])
     if (argc == 2) {
         snprintf(query, sizeof(query), "%s\n", argv[1]);
     } else {
-        snprintf(query, sizeof(query), "%s %s\n", argv[1], argv[2]);
+        snprintf(query, sizeof(query), "%s pid=%s\n", argv[1], argv[2]);
     }
 
     int fd = open(PROC_PATH, O_RDWR);
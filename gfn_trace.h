@@ -0,0 +1,72 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gfn_to_pfn
+
+#if !defined(GFN_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define GFN_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* A parsed text request; pid is 0 when the request did not name one. */
+TRACE_EVENT(gfn_request,
+            TP_PROTO(unsigned long gfn, unsigned long pid, unsigned long tag),
+            TP_ARGS(gfn, pid, tag),
+
+            TP_STRUCT__entry(__field(unsigned long, gfn)
+                             __field(unsigned long, pid)
+                             __field(unsigned long, tag)),
+
+            TP_fast_assign(__entry->gfn = gfn; __entry->pid = pid;
+                           __entry->tag = tag;),
+
+            TP_printk("gfn=0x%lx pid=%lu tag=%lu", __entry->gfn, __entry->pid,
+                      __entry->tag));
+
+/* VM resolution; hit is false when vm_list had to be scanned. */
+TRACE_EVENT(gfn_vm_lookup,
+            TP_PROTO(unsigned long pid, bool hit, int error),
+            TP_ARGS(pid, hit, error),
+
+            TP_STRUCT__entry(__field(unsigned long, pid) __field(bool, hit)
+                             __field(int, error)),
+
+            TP_fast_assign(__entry->pid = pid; __entry->hit = hit;
+                           __entry->error = error;),
+
+            TP_printk("pid=%lu hit=%d error=%d", __entry->pid, __entry->hit,
+                      __entry->error));
+
+TRACE_EVENT(gfn_hva,
+            TP_PROTO(unsigned long gfn, unsigned long hva, int error),
+            TP_ARGS(gfn, hva, error),
+
+            TP_STRUCT__entry(__field(unsigned long, gfn)
+                             __field(unsigned long, hva) __field(int, error)),
+
+            TP_fast_assign(__entry->gfn = gfn; __entry->hva = hva;
+                           __entry->error = error;),
+
+            TP_printk("gfn=0x%lx hva=0x%lx error=%d", __entry->gfn,
+                      __entry->hva, __entry->error));
+
+/* get_user_pages_remote() outcome; ret is its return value. */
+TRACE_EVENT(gfn_gup,
+            TP_PROTO(unsigned long hva, u64 phys, u32 kind, long ret),
+            TP_ARGS(hva, phys, kind, ret),
+
+            TP_STRUCT__entry(__field(unsigned long, hva) __field(u64, phys)
+                             __field(u32, kind) __field(long, ret)),
+
+            TP_fast_assign(__entry->hva = hva; __entry->phys = phys;
+                           __entry->kind = kind; __entry->ret = ret;),
+
+            TP_printk("hva=0x%lx phys=0x%llx kind=%u ret=%ld", __entry->hva,
+                      (unsigned long long)__entry->phys, __entry->kind,
+                      __entry->ret));
+
+#endif /* GFN_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gfn_trace
+#include <trace/define_trace.h>
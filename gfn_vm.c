@@ -0,0 +1,547 @@
+// gfn_vm.c
+#include <linux/kvm_host.h>
+#include <linux/mm.h>
+#include <linux/mmu_notifier.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/mm.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/xarray.h>
+
+#include "gfn_chlog.h"
+#include "gfn_map.h"
+#include "gfn_rmap.h"
+#include "gfn_trace.h"
+#include "gfn_vm.h"
+#include "gfn_watch.h"
+#include "gfn_xlate.h"
+
+#define CACHE_PROC_NAME "gfn_to_pfn_cache"
+/* How often the index is synced with vm_list so the per-VM files follow. */
+#define GFN_VM_RESCAN_INTERVAL (5 * HZ)
+
+static bool cache_enable;
+module_param_named(cache, cache_enable, bool, 0644);
+MODULE_PARM_DESC(cache, "Cache GFN translations per VM (default: off)");
+
+/* pid -> struct gfn_vm; loads under RCU, updates under gfn_vms_lock */
+static DEFINE_XARRAY(gfn_vms);
+static DEFINE_MUTEX(gfn_vms_lock);
+static struct workqueue_struct *gfn_vm_wq;
+static struct proc_dir_entry *cache_proc;
+
+static void gfn_vm_rescan(struct work_struct *work);
+static DECLARE_DELAYED_WORK(gfn_vm_rescan_work, gfn_vm_rescan);
+
+/* --- cache maintenance from the mmu_notifier --- */
+static void gfn_vm_drop_locked(struct gfn_vm *vm, unsigned long start,
+                               unsigned long end) {
+  XA_STATE(xas, &vm->cache, start >> PAGE_SHIFT);
+  unsigned long last = (end - 1) >> PAGE_SHIFT;
+  u64 dropped = 0;
+  void *entry;
+
+  xas_for_each(&xas, entry, last) {
+    xas_store(&xas, NULL);
+    dropped++;
+  }
+
+  if (dropped) {
+    atomic64_sub(dropped, &vm->entries);
+    atomic64_add(dropped, &vm->invalidations);
+  }
+}
+
+/* Protection and soft-dirty changes leave the PFN in place. */
+static bool gfn_vm_inval_moves(const struct mmu_notifier_range *range) {
+  switch (range->event) {
+  case MMU_NOTIFY_PROTECTION_VMA:
+  case MMU_NOTIFY_PROTECTION_PAGE:
+  case MMU_NOTIFY_SOFT_DIRTY:
+    return false;
+  default:
+    return true;
+  }
+}
+
+/*
+ * Unmap, migration, THP split and compaction all come through here before
+ * the old PFN goes away. Entries in the range are dropped and no new ones
+ * are stored until the matching invalidate_range_end(). Watches on the
+ * range are told, and the change log records it.
+ */
+static int gfn_vm_invalidate_start(struct mmu_notifier *mn,
+                                   const struct mmu_notifier_range *range) {
+  struct gfn_vm *vm = container_of(mn, struct gfn_vm, mn);
+
+  xa_lock(&vm->cache);
+  vm->invalidating++;
+  vm->inval_seq++;
+  if (gfn_vm_inval_moves(range))
+    vm->move_seq++;
+  gfn_vm_drop_locked(vm, range->start, range->end);
+  xa_unlock(&vm->cache);
+
+  if (gfn_vm_inval_moves(range)) {
+    gfn_watch_notify(vm, range->start, range->end);
+    gfn_chlog_note(vm, range->start, range->end);
+  }
+  return 0;
+}
+
+static void gfn_vm_invalidate_end(struct mmu_notifier *mn,
+                                  const struct mmu_notifier_range *range) {
+  struct gfn_vm *vm = container_of(mn, struct gfn_vm, mn);
+
+  xa_lock(&vm->cache);
+  vm->invalidating--;
+  vm->inval_seq++;
+  if (gfn_vm_inval_moves(range))
+    vm->move_seq++;
+  xa_unlock(&vm->cache);
+}
+
+static void gfn_vm_release_work(struct work_struct *work) {
+  struct gfn_vm *vm = container_of(work, struct gfn_vm, release_work);
+
+  mutex_lock(&gfn_vms_lock);
+  if (xa_cmpxchg(&gfn_vms, vm->pid, vm, NULL, GFP_KERNEL) == vm) {
+    gfn_map_remove(vm);
+    gfn_vm_put(vm);
+  }
+  mutex_unlock(&gfn_vms_lock);
+  gfn_vm_put(vm);
+}
+
+/*
+ * The VM is gone: refuse new pins, and leave dropping the index entry
+ * (which can sleep) to a worker. Only the first call queues it. The
+ * reference fails to take when this is called from
+ * mmu_notifier_unregister() in gfn_vm_free().
+ */
+static void gfn_vm_retire(struct gfn_vm *vm) {
+  bool live;
+
+  spin_lock(&vm->lock);
+  live = vm->kvm != NULL;
+  vm->kvm = NULL;
+  spin_unlock(&vm->lock);
+
+  if (live && kref_get_unless_zero(&vm->ref))
+    queue_work(gfn_vm_wq, &vm->release_work);
+}
+
+/* The VMM's mm is going away, so the VM is gone if it was not already. */
+static void gfn_vm_release(struct mmu_notifier *mn, struct mm_struct *mm) {
+  struct gfn_vm *vm = container_of(mn, struct gfn_vm, mn);
+
+  gfn_vm_retire(vm);
+
+  xa_lock(&vm->cache);
+  gfn_vm_drop_locked(vm, 0, ULONG_MAX);
+  vm->inval_seq++;
+  vm->move_seq++;
+  xa_unlock(&vm->cache);
+
+  /* Every watch on the VM fires one last time. */
+  gfn_watch_notify(vm, 0, ULONG_MAX);
+}
+
+static const struct mmu_notifier_ops gfn_vm_mn_ops = {
+    .invalidate_range_start = gfn_vm_invalidate_start,
+    .invalidate_range_end = gfn_vm_invalidate_end,
+    .release = gfn_vm_release,
+};
+
+/* --- lifetime --- */
+static void gfn_vm_free(struct kref *ref) {
+  struct gfn_vm *vm = container_of(ref, struct gfn_vm, ref);
+
+  mmu_notifier_unregister(&vm->mn, vm->mm);
+  xa_destroy(&vm->cache);
+  gfn_rmap_free(vm->rmap);
+  gfn_chlog_free(vm->chlog);
+  kfree_rcu(vm, rcu);
+}
+
+void gfn_vm_get(struct gfn_vm *vm) {
+  kref_get(&vm->ref);
+}
+
+void gfn_vm_put(struct gfn_vm *vm) {
+  if (vm)
+    kref_put(&vm->ref, gfn_vm_free);
+}
+
+/*
+ * Pin the VM for the duration of a request: a kvm reference plus an mm
+ * user, so neither the VM nor its address space can be torn down under
+ * the walk. The entry holds no kvm reference, so the kvm is looked up
+ * again on vm_list under kvm_lock, where kvm_get_kvm_safe() fails once
+ * it is being destroyed. Returns NULL once the VM is gone, and retires
+ * the entry so the next lookup of the pid scans again.
+ */
+struct kvm *gfn_vm_pin(struct gfn_vm *vm) {
+  struct kvm *want = READ_ONCE(vm->kvm), *kvm, *found = NULL;
+
+  if (!want)
+    return NULL;
+
+  mutex_lock(&kvm_lock);
+  list_for_each_entry(kvm, &vm_list, vm_list) {
+    if (kvm != want || kvm->mm != vm->mm)
+      continue;
+    if (kvm_get_kvm_safe(kvm))
+      found = kvm;
+    break;
+  }
+  mutex_unlock(&kvm_lock);
+
+  if (!found) {
+    gfn_vm_retire(vm);
+    return NULL;
+  }
+  if (!mmget_not_zero(found->mm)) {
+    kvm_put_kvm(found);
+    return NULL;
+  }
+  return found;
+}
+
+void gfn_vm_unpin(struct kvm *kvm) {
+  mmput(kvm->mm);
+  kvm_put_kvm(kvm);
+}
+
+/* The caller holds a kvm reference for as long as this runs. */
+static struct gfn_vm *gfn_vm_create(struct kvm *kvm) {
+  struct gfn_vm *vm;
+  int rc;
+
+  vm = kzalloc(sizeof(*vm), GFP_KERNEL);
+  if (!vm)
+    return NULL;
+
+  kref_init(&vm->ref);
+  INIT_WORK(&vm->release_work, gfn_vm_release_work);
+  spin_lock_init(&vm->lock);
+  xa_init(&vm->cache);
+  mutex_init(&vm->rmap_lock);
+  spin_lock_init(&vm->watch_lock);
+  INIT_LIST_HEAD(&vm->watches);
+  vm->kvm = kvm;
+  vm->mm = kvm->mm;
+  vm->pid = kvm->userspace_pid;
+  vm->mn.ops = &gfn_vm_mn_ops;
+
+  /* Registering needs a live mm; a VM whose VMM is exiting is not indexed. */
+  if (!mmget_not_zero(kvm->mm)) {
+    kfree(vm);
+    return NULL;
+  }
+  rc = mmu_notifier_register(&vm->mn, kvm->mm);
+  mmput(kvm->mm);
+  if (rc) {
+    kfree(vm);
+    return NULL;
+  }
+  return vm;
+}
+
+/*
+ * Index miss: find the VM on vm_list under kvm_lock and add it. With no
+ * pid, the first VM on the list is used. Returns the entry with a
+ * reference held for the caller.
+ */
+static struct gfn_vm *gfn_vm_scan(bool has_pid, unsigned long vm_pid) {
+  struct kvm *kvm, *found = NULL;
+  struct gfn_vm *vm, *old;
+  int rc = has_pid ? -ESRCH : -ENODEV;
+
+  mutex_lock(&gfn_vms_lock);
+
+  mutex_lock(&kvm_lock);
+  list_for_each_entry(kvm, &vm_list, vm_list) {
+    if (has_pid && kvm->userspace_pid != vm_pid)
+      continue;
+    if (kvm_get_kvm_safe(kvm)) {
+      found = kvm;
+      break;
+    }
+  }
+  mutex_unlock(&kvm_lock);
+
+  if (!found) {
+    vm = ERR_PTR(rc);
+    goto out;
+  }
+
+  vm = xa_load(&gfn_vms, found->userspace_pid);
+  if (vm && READ_ONCE(vm->kvm) == found) {
+    gfn_vm_get(vm);
+    goto out;
+  }
+
+  vm = gfn_vm_create(found);
+  if (!vm) {
+    vm = ERR_PTR(rc);
+    goto out;
+  }
+
+  /*
+   * A stale entry (recycled pid, or a second VM in the same process) is
+   * replaced and loses its index reference here; its own release then
+   * finds the slot taken and leaves it alone.
+   */
+  old = xa_store(&gfn_vms, vm->pid, vm, GFP_KERNEL);
+  if (xa_is_err(old)) {
+    gfn_vm_put(vm);
+    vm = ERR_PTR(-ENOMEM);
+    goto out;
+  }
+  if (old) {
+    gfn_map_remove(old);
+    gfn_vm_put(old);
+  }
+  gfn_map_add(vm);
+  gfn_vm_get(vm);
+
+out:
+  mutex_unlock(&gfn_vms_lock);
+  /* The scan's reference; may be the last one and destroy the VM. */
+  if (found)
+    kvm_put_kvm(found);
+  return vm;
+}
+
+/*
+ * Look up the VM a request targets: by pid, or the first one. Hits are a
+ * single xarray load; misses fall back to gfn_vm_scan(). Returns the entry
+ * with a reference held, or ERR_PTR(-ESRCH) / ERR_PTR(-ENODEV).
+ */
+struct gfn_vm *gfn_vm_lookup(bool has_pid, unsigned long vm_pid) {
+  struct gfn_vm *vm;
+
+  if (has_pid) {
+    rcu_read_lock();
+    vm = xa_load(&gfn_vms, vm_pid);
+    if (vm && (!READ_ONCE(vm->kvm) || !kref_get_unless_zero(&vm->ref)))
+      vm = NULL;
+    rcu_read_unlock();
+    if (vm) {
+      trace_gfn_vm_lookup(vm_pid, true, 0);
+      return vm;
+    }
+  }
+
+  vm = gfn_vm_scan(has_pid, vm_pid);
+  trace_gfn_vm_lookup(IS_ERR(vm) ? vm_pid : vm->pid, false,
+                      PTR_ERR_OR_ZERO(vm));
+  return vm;
+}
+
+/* Next indexed VM after *pid, with a reference held; start from 0. */
+struct gfn_vm *gfn_vm_next(unsigned long *pid) {
+  struct gfn_vm *vm;
+
+  rcu_read_lock();
+  do {
+    vm = xa_find_after(&gfn_vms, pid, ULONG_MAX, XA_PRESENT);
+  } while (vm && !kref_get_unless_zero(&vm->ref));
+  rcu_read_unlock();
+  return vm;
+}
+
+/* --- keeping the index in step with vm_list --- */
+/* Whether want is still on vm_list; kvm_lock held. */
+static bool gfn_vm_listed(struct kvm *want) {
+  struct kvm *kvm;
+
+  list_for_each_entry(kvm, &vm_list, vm_list) {
+    if (kvm == want)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Index every VM on vm_list that is not indexed yet, and retire entries
+ * whose VM has left it. Whole-host queries call this first so they also
+ * cover VMs no request has named, and the rescan worker calls it so the
+ * per-VM files follow VM creation and destruction. Entries hold no kvm
+ * reference, so a VM costs one mmu_notifier registration here, once.
+ */
+void gfn_vm_sync(void) {
+  struct gfn_vm *vm;
+  struct kvm *kvm;
+  unsigned long pid;
+  pid_t *pids;
+  int i, n = 0, nr = 0;
+
+  mutex_lock(&kvm_lock);
+  list_for_each_entry(kvm, &vm_list, vm_list)
+    nr++;
+  pids = kmalloc_array(nr, sizeof(*pids), GFP_KERNEL);
+  if (pids) {
+    rcu_read_lock();
+    list_for_each_entry(kvm, &vm_list, vm_list) {
+      vm = xa_load(&gfn_vms, kvm->userspace_pid);
+      if (!vm || READ_ONCE(vm->kvm) != kvm)
+        pids[n++] = kvm->userspace_pid;
+    }
+    rcu_read_unlock();
+  }
+  mutex_unlock(&kvm_lock);
+
+  for (i = 0; i < n; i++) {
+    vm = gfn_vm_scan(true, pids[i]);
+    if (!IS_ERR(vm))
+      gfn_vm_put(vm);
+  }
+  kfree(pids);
+
+  mutex_lock(&gfn_vms_lock);
+  mutex_lock(&kvm_lock);
+  xa_for_each(&gfn_vms, pid, vm) {
+    kvm = READ_ONCE(vm->kvm);
+    if (kvm && !gfn_vm_listed(kvm))
+      gfn_vm_retire(vm);
+  }
+  mutex_unlock(&kvm_lock);
+  mutex_unlock(&gfn_vms_lock);
+}
+
+static void gfn_vm_rescan(struct work_struct *work) {
+  gfn_vm_sync();
+  queue_delayed_work(gfn_vm_wq, &gfn_vm_rescan_work, GFN_VM_RESCAN_INTERVAL);
+}
+
+/*
+ * Bumped when an invalidation starts and again when it ends, so anything
+ * derived from the page tables under an older value may be stale.
+ */
+u64 gfn_vm_inval_seq(struct gfn_vm *vm) {
+  u64 seq;
+
+  xa_lock(&vm->cache);
+  seq = vm->inval_seq;
+  xa_unlock(&vm->cache);
+  return seq;
+}
+
+/*
+ * Like gfn_vm_inval_seq(), but protection and soft-dirty changes, which
+ * leave every PFN where it was, do not bump it.
+ */
+u64 gfn_vm_move_seq(struct gfn_vm *vm) {
+  u64 seq;
+
+  xa_lock(&vm->cache);
+  seq = vm->move_seq;
+  xa_unlock(&vm->cache);
+  return seq;
+}
+
+/* --- cached lookup --- */
+#define GFN_CACHE_KIND_BITS 2
+
+/*
+ * gfn_xlate_page() behind the per-VM cache, when enabled. A miss is only
+ * stored if no invalidation started or completed while the page was being
+ * resolved, so a racing unmap cannot leave a stale PFN behind.
+ */
+long gfn_vm_xlate_page(struct gfn_vm *vm, struct mm_struct *mm,
+                       struct gfn_xlate_result *res) {
+  unsigned long index = res->hva >> PAGE_SHIFT;
+  unsigned long val;
+  void *entry;
+  u64 seq;
+  long ret;
+
+  if (!READ_ONCE(cache_enable))
+    return gfn_xlate_page(mm, res);
+
+  entry = xa_load(&vm->cache, index);
+  if (entry) {
+    val = xa_to_value(entry);
+    res->phys = PFN_PHYS(val >> GFN_CACHE_KIND_BITS) | (res->hva & 0xFFF);
+    res->kind = val & ((1UL << GFN_CACHE_KIND_BITS) - 1);
+    gfn_page_place(val >> GFN_CACHE_KIND_BITS, &res->node, &res->zone);
+    atomic64_inc(&vm->hits);
+    return 1;
+  }
+  atomic64_inc(&vm->misses);
+
+  xa_lock(&vm->cache);
+  seq = vm->inval_seq;
+  xa_unlock(&vm->cache);
+
+  ret = gfn_xlate_page(mm, res);
+  if (ret <= 0)
+    return ret;
+
+  val = (PHYS_PFN(res->phys) << GFN_CACHE_KIND_BITS) | res->kind;
+  xa_lock(&vm->cache);
+  if (!vm->invalidating && vm->inval_seq == seq) {
+    entry = __xa_cmpxchg(&vm->cache, index, NULL, xa_mk_value(val),
+                         GFP_ATOMIC);
+    if (!entry)
+      atomic64_inc(&vm->entries);
+  }
+  xa_unlock(&vm->cache);
+  return ret;
+}
+
+/* --- /proc/gfn_to_pfn_cache --- */
+static int gfn_vm_cache_show(struct seq_file *m, void *v) {
+  struct gfn_vm *vm;
+  unsigned long pid;
+
+  mutex_lock(&gfn_vms_lock);
+  xa_for_each(&gfn_vms, pid, vm) {
+    seq_printf(m, "pid=%d entries=%lld hits=%lld misses=%lld "
+                  "invalidations=%lld\n",
+               vm->pid, atomic64_read(&vm->entries),
+               atomic64_read(&vm->hits), atomic64_read(&vm->misses),
+               atomic64_read(&vm->invalidations));
+  }
+  mutex_unlock(&gfn_vms_lock);
+  return 0;
+}
+
+int gfn_vm_init(void) {
+  gfn_vm_wq = alloc_workqueue("gfn_vm", 0, 0);
+  if (!gfn_vm_wq)
+    return -ENOMEM;
+
+  cache_proc = proc_create_single(CACHE_PROC_NAME, 0444, NULL,
+                                  gfn_vm_cache_show);
+  if (!cache_proc) {
+    destroy_workqueue(gfn_vm_wq);
+    return -ENOMEM;
+  }
+
+  queue_delayed_work(gfn_vm_wq, &gfn_vm_rescan_work, 0);
+  return 0;
+}
+
+void gfn_vm_exit(void) {
+  struct gfn_vm *vm;
+  unsigned long pid;
+
+  proc_remove(cache_proc);
+  cancel_delayed_work_sync(&gfn_vm_rescan_work);
+
+  mutex_lock(&gfn_vms_lock);
+  xa_for_each(&gfn_vms, pid, vm) {
+    xa_erase(&gfn_vms, pid);
+    gfn_map_remove(vm);
+    gfn_vm_put(vm);
+  }
+  mutex_unlock(&gfn_vms_lock);
+
+  destroy_workqueue(gfn_vm_wq);
+}
@@ -0,0 +1,80 @@
+#ifndef GFN_VM_H
+#define GFN_VM_H
+
+#include <linux/kref.h>
+#include <linux/kvm_host.h>
+#include <linux/mmu_notifier.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+#include "gfn_ioctl.h"
+
+struct gfn_chlog;
+struct gfn_rmap;
+
+/*
+ * Per-VM module state, indexed by the VM's userspace pid and tied to its mm
+ * through an mmu_notifier.
+ *
+ * A VM is indexed by the first request that names it, or by gfn_vm_sync(),
+ * which whole-host queries and a periodic worker run over vm_list. The
+ * entry holds no kvm reference, so a VM whose fd is closed is destroyed as
+ * usual while the VMM lives on. kvm only identifies the VM; requests pin
+ * it with gfn_vm_pin(), which finds it again on vm_list, while they run.
+ *
+ * The translation cache is keyed by host virtual page (hva >> PAGE_SHIFT)
+ * rather than by GFN: invalidations arrive as HVA ranges and apply without
+ * going back through the memslots, and a memslot that moves to a new HVA
+ * cannot return a stale entry.
+ */
+struct gfn_vm {
+  struct mmu_notifier mn;
+  struct kref ref; /* the index holds one */
+  struct rcu_head rcu;
+  struct work_struct release_work;
+  struct mm_struct *mm;
+  pid_t pid;
+  struct proc_dir_entry *map_proc; /* under gfn_vms_lock */
+  struct proc_dir_entry *mem_proc; /* under gfn_vms_lock */
+
+  spinlock_t lock; /* protects kvm */
+  struct kvm *kvm; /* not a reference; NULL once the VM is gone */
+
+  struct xarray cache;       /* hva page -> xa_mk_value(pfn << 2 | kind) */
+  unsigned int invalidating; /* under the cache xa_lock */
+  u64 inval_seq;             /* under the cache xa_lock */
+  u64 move_seq;              /* likewise; only changes that move PFNs */
+
+  struct mutex rmap_lock;
+  struct gfn_rmap *rmap; /* PFN -> GFN table, built on demand */
+
+  spinlock_t watch_lock;
+  struct list_head watches; /* struct gfn_watch, each holding a ref */
+
+  struct gfn_chlog *chlog; /* changed ranges, set once by the first query */
+
+  atomic64_t entries;
+  atomic64_t hits;
+  atomic64_t misses;
+  atomic64_t invalidations;
+};
+
+struct gfn_vm *gfn_vm_lookup(bool has_pid, unsigned long vm_pid);
+struct gfn_vm *gfn_vm_next(unsigned long *pid);
+void gfn_vm_sync(void);
+void gfn_vm_get(struct gfn_vm *vm);
+void gfn_vm_put(struct gfn_vm *vm);
+struct kvm *gfn_vm_pin(struct gfn_vm *vm);
+void gfn_vm_unpin(struct kvm *kvm);
+
+u64 gfn_vm_inval_seq(struct gfn_vm *vm);
+u64 gfn_vm_move_seq(struct gfn_vm *vm);
+long gfn_vm_xlate_page(struct gfn_vm *vm, struct mm_struct *mm,
+                       struct gfn_xlate_result *res);
+
+int gfn_vm_init(void);
+void gfn_vm_exit(void);
+
+#endif /* GFN_VM_H */
@@ -0,0 +1,154 @@
+// gfn_watch.c
+#include <linux/kvm_host.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "gfn_vm.h"
+#include "gfn_watch.h"
+
+/* Registered ranges per fd, counted after splitting at memslots. */
+#define GFN_WATCH_MAX 4096
+
+/*
+ * The part of a watched GFN range that lies in one memslot, kept by HVA
+ * because that is how invalidations arrive. The memslot layout is taken
+ * when the watch is added; a memslot moved afterwards is not followed.
+ */
+struct gfn_watch {
+  struct list_head vm_node; /* on vm->watches, under vm->watch_lock */
+  struct list_head node;    /* on wr->watches, under wr->lock */
+  struct gfn_watcher *wr;
+  struct gfn_vm *vm; /* holds a reference */
+  gfn_t gfn;
+  unsigned long hva;
+  unsigned long npages;
+  u64 cookie;
+};
+
+void gfn_watcher_init(struct gfn_watcher *wr, gfn_watch_notify_t notify) {
+  mutex_init(&wr->lock);
+  INIT_LIST_HEAD(&wr->watches);
+  wr->nr = 0;
+  wr->notify = notify;
+}
+
+/* Unhook w from its VM; no notification for it runs after this. */
+static void gfn_watch_free(struct gfn_watch *w) {
+  spin_lock(&w->vm->watch_lock);
+  list_del(&w->vm_node);
+  spin_unlock(&w->vm->watch_lock);
+  gfn_vm_put(w->vm);
+  kfree(w);
+}
+
+/*
+ * Watch guest pages [gfn, gfn + npages) of vm. The range is split at
+ * memslot boundaries; pages outside every memslot are ignored, and a
+ * range with none inside fails with -EFAULT.
+ */
+int gfn_watch_add(struct gfn_watcher *wr, struct gfn_vm *vm, struct kvm *kvm,
+                  gfn_t gfn, u64 npages, u64 cookie) {
+  gfn_t end = gfn + npages;
+  struct kvm_memory_slot *slot;
+  struct gfn_watch *w, *tmp;
+  unsigned int n = 0;
+  LIST_HEAD(added);
+  int bkt, idx, rc = 0;
+
+  mutex_lock(&wr->lock);
+  idx = srcu_read_lock(&kvm->srcu);
+  kvm_for_each_memslot(slot, bkt, kvm_memslots(kvm)) {
+    gfn_t s = max_t(gfn_t, gfn, slot->base_gfn);
+    gfn_t e = min_t(gfn_t, end, slot->base_gfn + slot->npages);
+
+    if (s >= e)
+      continue;
+    if (wr->nr + n == GFN_WATCH_MAX) {
+      rc = -ENOSPC;
+      break;
+    }
+    w = kzalloc(sizeof(*w), GFP_KERNEL);
+    if (!w) {
+      rc = -ENOMEM;
+      break;
+    }
+    w->wr = wr;
+    w->vm = vm;
+    w->gfn = s;
+    w->hva = gfn_to_hva_memslot(slot, s);
+    w->npages = e - s;
+    w->cookie = cookie;
+    list_add_tail(&w->node, &added);
+    n++;
+  }
+  srcu_read_unlock(&kvm->srcu, idx);
+
+  if (!rc && !n)
+    rc = -EFAULT;
+  if (rc) {
+    list_for_each_entry_safe(w, tmp, &added, node)
+      kfree(w);
+    mutex_unlock(&wr->lock);
+    return rc;
+  }
+
+  list_for_each_entry(w, &added, node) {
+    gfn_vm_get(vm);
+    spin_lock(&vm->watch_lock);
+    list_add_tail(&w->vm_node, &vm->watches);
+    spin_unlock(&vm->watch_lock);
+  }
+  list_splice_tail(&added, &wr->watches);
+  wr->nr += n;
+  mutex_unlock(&wr->lock);
+  return 0;
+}
+
+/* Drop the watches added with cookie, or all of them for cookie 0. */
+int gfn_watch_del(struct gfn_watcher *wr, u64 cookie) {
+  struct gfn_watch *w, *tmp;
+  int n = 0;
+
+  mutex_lock(&wr->lock);
+  list_for_each_entry_safe(w, tmp, &wr->watches, node) {
+    if (cookie && w->cookie != cookie)
+      continue;
+    list_del(&w->node);
+    gfn_watch_free(w);
+    n++;
+  }
+  wr->nr -= n;
+  mutex_unlock(&wr->lock);
+  return n ? 0 : -ENOENT;
+}
+
+void gfn_watcher_clear(struct gfn_watcher *wr) {
+  gfn_watch_del(wr, 0);
+}
+
+/*
+ * From the invalidate_range_start() of vm's mm: tell every watch that
+ * overlaps [start, end) which of its pages are about to change. A watch
+ * list is short, so it is scanned linearly; VMs with no watches only pay
+ * for the list_empty() check.
+ */
+void gfn_watch_notify(struct gfn_vm *vm, unsigned long start,
+                      unsigned long end) {
+  struct gfn_watch *w;
+
+  if (list_empty(&vm->watches))
+    return;
+
+  spin_lock(&vm->watch_lock);
+  list_for_each_entry(w, &vm->watches, vm_node) {
+    unsigned long s = max(start, w->hva);
+    unsigned long e = min(end, w->hva + (w->npages << PAGE_SHIFT));
+
+    if (s >= e)
+      continue;
+    w->wr->notify(w->wr, vm->pid, w->gfn + ((s - w->hva) >> PAGE_SHIFT),
+                  DIV_ROUND_UP(e - s, PAGE_SIZE), w->cookie);
+  }
+  spin_unlock(&vm->watch_lock);
+}
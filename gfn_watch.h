@@ -0,0 +1,37 @@
+#ifndef GFN_WATCH_H
+#define GFN_WATCH_H
+
+#include <linux/kvm_host.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+
+struct gfn_vm;
+struct gfn_watcher;
+
+/*
+ * Called from the VM's mmu_notifier with its watch lock held, before the
+ * pages go away: must not sleep. gfn and npages are the part of the watch
+ * the invalidation covers.
+ */
+typedef void (*gfn_watch_notify_t)(struct gfn_watcher *wr, pid_t pid,
+                                   gfn_t gfn, unsigned long npages,
+                                   u64 cookie);
+
+/* The watches registered through one fd. */
+struct gfn_watcher {
+  struct mutex lock; /* protects watches and nr */
+  struct list_head watches;
+  unsigned int nr;
+  gfn_watch_notify_t notify;
+};
+
+void gfn_watcher_init(struct gfn_watcher *wr, gfn_watch_notify_t notify);
+void gfn_watcher_clear(struct gfn_watcher *wr);
+int gfn_watch_add(struct gfn_watcher *wr, struct gfn_vm *vm, struct kvm *kvm,
+                  gfn_t gfn, u64 npages, u64 cookie);
+int gfn_watch_del(struct gfn_watcher *wr, u64 cookie);
+
+void gfn_watch_notify(struct gfn_vm *vm, unsigned long start,
+                      unsigned long end);
+
+#endif /* GFN_WATCH_H */
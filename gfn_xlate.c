@@ -0,0 +1,602 @@
+// gfn_xlate.c
+#include <linux/bitmap.h>
+#include <linux/hugetlb.h>
+#include <linux/kvm_host.h>
+#include <linux/mm.h>
+#include <linux/mmap_lock.h>
+#include <linux/mmu_notifier.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+
+#include "gfn_trace.h"
+#include "gfn_vm.h"
+#include "gfn_xlate.h"
+
+const char *const gfn_kind_names[] = {
+    [GFN_KIND_NONE] = "none",
+    [GFN_KIND_BASE] = "base",
+    [GFN_KIND_THP] = "thp",
+    [GFN_KIND_HUGETLB] = "hugetlb",
+};
+
+/*
+ * Classify through the folio: GUP hands back the exact subpage, and the
+ * PageTransHuge()/PageHuge() tests only hold for the head page.
+ */
+static u32 gfn_page_kind(struct page *page) {
+  struct folio *folio = page_folio(page);
+
+  if (folio_test_hugetlb(folio))
+    return GFN_KIND_HUGETLB;
+  if (folio_test_large(folio))
+    return GFN_KIND_THP;
+  return GFN_KIND_BASE;
+}
+
+/*
+ * Host node and zone of pfn. Memory without an online struct page (PFNMAP
+ * regions, offlined sections) reports GFN_NODE_NONE.
+ */
+void gfn_page_place(unsigned long pfn, s32 *node, u32 *zone) {
+  struct page *page = pfn_to_online_page(pfn);
+
+  *node = page ? page_to_nid(page) : GFN_NODE_NONE;
+  *zone = page ? page_zonenum(page) : 0;
+}
+
+const char *gfn_zone_name(s32 node, u32 zone) {
+  if (node < 0 || node >= nr_node_ids || !node_online(node) ||
+      zone >= MAX_NR_ZONES)
+    return "none";
+  return NODE_DATA(node)->node_zones[zone].name;
+}
+
+/* --- translate gfn to hva --- */
+long gfn_to_hva_safe(struct kvm *kvm, unsigned long full_gfn,
+                     unsigned long *out_hva) {
+  gfn_t gfn = (gfn_t)(full_gfn >> 12);
+  unsigned long off = full_gfn & 0xFFF;
+  unsigned long hva = gfn_to_hva(kvm, gfn);
+  if (kvm_is_error_hva(hva)) {
+    trace_gfn_hva(full_gfn, 0, -EFAULT);
+    return -EFAULT;
+  }
+  *out_hva = hva | off;
+  trace_gfn_hva(full_gfn, *out_hva, 0);
+  return 0;
+}
+
+/* --- resolve the page behind res->hva, mmap lock held --- */
+long gfn_xlate_page(struct mm_struct *mm, struct gfn_xlate_result *res) {
+  long ret;
+  struct page *pages[1] = {NULL};
+  unsigned long base_va = res->hva & PAGE_MASK;
+  unsigned long offset = res->hva & 0xFFF;
+
+  ret = get_user_pages_remote(mm, base_va, 1, FOLL_GET, pages, NULL);
+  if (ret <= 0) {
+    res->error = ret ? ret : -EFAULT;
+    trace_gfn_gup(res->hva, 0, GFN_KIND_NONE, ret);
+    return ret;
+  }
+
+  res->phys = PFN_PHYS(page_to_pfn(pages[0])) | offset;
+  res->kind = gfn_page_kind(pages[0]);
+  res->node = page_to_nid(pages[0]);
+  res->zone = page_zonenum(pages[0]);
+  put_page(pages[0]);
+  trace_gfn_gup(res->hva, res->phys, res->kind, ret);
+  return ret;
+}
+
+/*
+ * Look up what is mapped at addr right now without pinning or faulting.
+ * Returns -EFAULT when addr is outside any VMA and -ENOENT when nothing is
+ * populated there; w->size is then the span of the empty table entry, so
+ * callers can skip it whole. Caller holds the mmap read lock, which keeps
+ * the upper levels from being freed; pte_offset_map() covers the PTE table.
+ *
+ * The host accessed and dirty bits of the entry are reported as well. With
+ * GFN_WALK_CLEAR_YOUNG the accessed bit of a PMD or PTE mapping is
+ * test-and-cleared under its page table lock; PUD mappings are only read.
+ */
+int gfn_walk_hva(struct mm_struct *mm, unsigned long addr, u32 flags,
+                 struct gfn_walk *w) {
+  bool clear = flags & GFN_WALK_CLEAR_YOUNG;
+  struct vm_area_struct *vma;
+  pgd_t *pgdp;
+  p4d_t *p4dp;
+  pud_t *pudp, pud;
+  pmd_t *pmdp, pmd;
+  pte_t *ptep, pte;
+  spinlock_t *ptl;
+  bool hugetlb;
+
+  w->size = PAGE_SIZE;
+  vma = vma_lookup(mm, addr);
+  if (!vma)
+    return -EFAULT;
+  hugetlb = is_vm_hugetlb_page(vma);
+
+  pgdp = pgd_offset(mm, addr);
+  w->size = PGDIR_SIZE;
+  if (pgd_none(READ_ONCE(*pgdp)) || pgd_bad(READ_ONCE(*pgdp)))
+    return -ENOENT;
+
+  p4dp = p4d_offset(pgdp, addr);
+  w->size = P4D_SIZE;
+  if (p4d_none(READ_ONCE(*p4dp)) || p4d_bad(READ_ONCE(*p4dp)))
+    return -ENOENT;
+
+  pudp = pud_offset(p4dp, addr);
+  pud = READ_ONCE(*pudp);
+  w->size = PUD_SIZE;
+  if (!pud_present(pud))
+    return -ENOENT;
+  if (pud_leaf(pud)) {
+    w->pfn = pud_pfn(pud) + ((addr & ~PUD_MASK) >> PAGE_SHIFT);
+    w->kind = hugetlb ? GFN_KIND_HUGETLB : GFN_KIND_THP;
+    w->young = pud_young(pud);
+    w->dirty = pud_dirty(pud);
+    return 0;
+  }
+  if (pud_bad(pud))
+    return -ENOENT;
+
+  pmdp = pmd_offset(pudp, addr);
+  pmd = pmdp_get_lockless(pmdp);
+  w->size = PMD_SIZE;
+  if (!pmd_present(pmd))
+    return -ENOENT;
+  if (pmd_leaf(pmd)) {
+    w->young = pmd_young(pmd);
+    if (clear) {
+      ptl = pmd_lock(mm, pmdp);
+      pmd = *pmdp;
+      if (!pmd_present(pmd) || !pmd_leaf(pmd)) {
+        spin_unlock(ptl);
+        return -ENOENT;
+      }
+      w->young = pmdp_test_and_clear_young(vma, addr & PMD_MASK, pmdp);
+      spin_unlock(ptl);
+    }
+    w->pfn = pmd_pfn(pmd) + ((addr & ~PMD_MASK) >> PAGE_SHIFT);
+    w->kind = hugetlb ? GFN_KIND_HUGETLB : GFN_KIND_THP;
+    w->dirty = pmd_dirty(pmd);
+    return 0;
+  }
+  if (pmd_bad(pmd))
+    return -ENOENT;
+
+  w->size = PAGE_SIZE;
+  if (clear) {
+    ptep = pte_offset_map_lock(mm, pmdp, addr, &ptl);
+    if (!ptep)
+      return -ENOENT;
+    pte = ptep_get(ptep);
+    if (pte_present(pte))
+      w->young = ptep_test_and_clear_young(vma, addr, ptep);
+    pte_unmap_unlock(ptep, ptl);
+  } else {
+    ptep = pte_offset_map(pmdp, addr);
+    if (!ptep)
+      return -ENOENT;
+    pte = ptep_get(ptep);
+    pte_unmap(ptep);
+    w->young = pte_young(pte);
+  }
+  if (!pte_present(pte))
+    return -ENOENT;
+
+  w->pfn = pte_pfn(pte);
+  w->kind = hugetlb ? GFN_KIND_HUGETLB : GFN_KIND_BASE;
+  w->dirty = pte_dirty(pte);
+  return 0;
+}
+
+/* --- non-pinning counterpart of gfn_xlate_page(), mmap lock held --- */
+int gfn_xlate_walk(struct mm_struct *mm, struct gfn_xlate_result *res) {
+  struct gfn_walk w;
+  int ret;
+
+  ret = gfn_walk_hva(mm, res->hva & PAGE_MASK, 0, &w);
+  if (ret) {
+    res->kind = GFN_KIND_NONE;
+    res->error = ret;
+    return ret;
+  }
+
+  res->phys = PFN_PHYS(w.pfn) | (res->hva & 0xFFF);
+  res->kind = w.kind;
+  gfn_page_place(w.pfn, &res->node, &res->zone);
+  return 0;
+}
+
+/* --- translate one batch entry, kvm->srcu and mmap lock held --- */
+void gfn_xlate_one(struct kvm *kvm, struct gfn_vm *vm,
+                   const struct gfn_xlate_req *req,
+                   struct gfn_xlate_result *res) {
+  unsigned long hva;
+
+  memset(res, 0, sizeof(*res));
+  res->gpa = req->gfn;
+
+  if ((req->flags & ~GFN_XLATE_NOFAULT) || req->reserved) {
+    res->error = -EINVAL;
+    return;
+  }
+
+  if (gfn_to_hva_safe(kvm, req->gfn, &hva)) {
+    res->error = -EFAULT;
+    return;
+  }
+  res->hva = hva;
+
+  if (req->flags & GFN_XLATE_NOFAULT)
+    gfn_xlate_walk(kvm->mm, res);
+  else
+    gfn_vm_xlate_page(vm, kvm->mm, res);
+}
+
+static bool gfn_slot_contains(const struct kvm_memory_slot *slot, gfn_t gfn) {
+  return slot && gfn >= slot->base_gfn && gfn < slot->base_gfn + slot->npages;
+}
+
+/* First memslot gfn above gfn, or end if no slot starts before it. */
+static gfn_t gfn_next_slot(struct kvm *kvm, gfn_t gfn, gfn_t end) {
+  struct kvm_memslots *slots = kvm_memslots(kvm);
+  struct kvm_memory_slot *slot;
+  gfn_t next = end;
+  int bkt;
+
+  kvm_for_each_memslot(slot, bkt, slots) {
+    if (slot->base_gfn > gfn && slot->base_gfn < next)
+      next = slot->base_gfn;
+  }
+  return next;
+}
+
+/* Pin up to nr pages at hva and hand them to the sink one page at a time. */
+static unsigned long gfn_run_gup(struct mm_struct *mm, gfn_t gfn,
+                                 unsigned long hva, unsigned long nr,
+                                 struct gfn_sink *sink) {
+  struct page *pages[GFN_GUP_CHUNK];
+  struct gfn_run run = {.gfn = gfn, .hva = hva, .npages = 1};
+  unsigned long done = 0;
+  long got, i;
+
+  nr = min_t(unsigned long, nr, GFN_GUP_CHUNK);
+  got = get_user_pages_remote(mm, hva, nr, FOLL_GET, pages, NULL);
+  if (got <= 0) {
+    run.error = got ? got : -EFAULT;
+    return sink->emit(sink, &run);
+  }
+
+  for (i = 0; i < got; i++) {
+    if (done == i) {
+      run.gfn = gfn + i;
+      run.hva = hva + i * PAGE_SIZE;
+      run.pfn = page_to_pfn(pages[i]);
+      run.kind = gfn_page_kind(pages[i]);
+      run.node = page_to_nid(pages[i]);
+      run.zone = page_zonenum(pages[i]);
+      done += sink->emit(sink, &run);
+    }
+    put_page(pages[i]);
+  }
+  return done;
+}
+
+/*
+ * Walk one mapping at hva; a huge mapping or an empty table is one run.
+ * With GFN_WALK_YOUNG, young also reflects secondary MMUs (KVM's EPT/NPT
+ * accessed bits, which is where guest accesses land), and
+ * GFN_WALK_CLEAR_YOUNG clears them there too, like idle page tracking.
+ */
+static unsigned long gfn_run_walk(struct mm_struct *mm, gfn_t gfn,
+                                  unsigned long hva, unsigned long nr,
+                                  u32 flags, struct gfn_sink *sink) {
+  struct gfn_run run = {.gfn = gfn, .hva = hva, .npages = 1};
+  struct gfn_walk w;
+  unsigned long start, end;
+  int ret;
+
+  ret = gfn_walk_hva(mm, hva, flags, &w);
+  run.npages = (ALIGN(hva + 1, w.size) - hva) >> PAGE_SHIFT;
+  run.npages = min(run.npages, nr);
+  run.map_size = w.size;
+  if (ret) {
+    run.error = ret;
+    return sink->emit(sink, &run);
+  }
+
+  run.pfn = w.pfn;
+  run.kind = w.kind;
+  /* A huge mapping is one folio, so one node and zone cover the run. */
+  gfn_page_place(w.pfn, &run.node, &run.zone);
+  run.young = w.young;
+  run.dirty = w.dirty;
+
+  /* run.npages is already within nr, so only pages reported are aged. */
+  start = hva & PAGE_MASK;
+  end = start + run.npages * PAGE_SIZE;
+  if (flags & GFN_WALK_CLEAR_YOUNG)
+    run.young |= mmu_notifier_clear_young(mm, start, end);
+  else if (flags & GFN_WALK_YOUNG)
+    run.young |= mmu_notifier_test_young(mm, start, end);
+  return sink->emit(sink, &run);
+}
+
+/*
+ * Feed the translation of [gfn, end) to sink as runs of pages, stopping
+ * early when the sink is full. Runs are cut to the sink's room before
+ * they are walked. The memslot is only looked up again once
+ * the walk leaves it. In the default mode pages are pinned GFN_GUP_CHUNK
+ * at a time; with GFN_XLATE_NOFAULT the page tables are walked once per
+ * mapping. The caller holds kvm->srcu and the mmap read lock. Returns the
+ * first gfn not consumed so the caller can drop the locks, flush and
+ * resume.
+ */
+gfn_t gfn_walk_range(struct kvm *kvm, gfn_t gfn, gfn_t end, u32 flags,
+                     struct gfn_sink *sink) {
+  struct kvm_memory_slot *slot = NULL;
+
+  while (gfn < end) {
+    struct gfn_run hole = {.gfn = gfn, .npages = 1, .error = -EFAULT};
+    unsigned long hva, nr, done;
+
+    if (!gfn_slot_contains(slot, gfn))
+      slot = gfn_to_memslot(kvm, gfn);
+
+    if (!slot)
+      hole.npages = gfn_next_slot(kvm, gfn, end) - gfn;
+
+    hva = slot ? gfn_to_hva_memslot(slot, gfn) : KVM_HVA_ERR_BAD;
+    if (kvm_is_error_hva(hva)) {
+      done = sink->emit(sink, &hole);
+    } else {
+      nr = min_t(u64, end - gfn, slot->base_gfn + slot->npages - gfn);
+      if (sink->room)
+        nr = min(nr, sink->room(sink));
+      if (!nr)
+        done = 0;
+      else if (flags & GFN_XLATE_NOFAULT)
+        done = gfn_run_walk(kvm->mm, gfn, hva, nr, flags, sink);
+      else
+        done = gfn_run_gup(kvm->mm, gfn, hva, nr, sink);
+    }
+    if (!done)
+      break;
+    gfn += done;
+    cond_resched();
+  }
+  return gfn;
+}
+
+struct gfn_result_sink {
+  struct gfn_sink sink;
+  struct gfn_xlate_result *out;
+  size_t n, cap;
+};
+
+static unsigned long gfn_result_emit(struct gfn_sink *sink,
+                                     const struct gfn_run *run) {
+  struct gfn_result_sink *rs = container_of(sink, struct gfn_result_sink, sink);
+  unsigned long i, take = min_t(unsigned long, run->npages, rs->cap - rs->n);
+
+  for (i = 0; i < take; i++) {
+    struct gfn_xlate_result *res = &rs->out[rs->n + i];
+
+    memset(res, 0, sizeof(*res));
+    res->gpa = (u64)(run->gfn + i) << PAGE_SHIFT;
+    res->hva = run->hva ? run->hva + i * PAGE_SIZE : 0;
+    res->error = run->error;
+    res->node = GFN_NODE_NONE;
+    if (!run->error) {
+      res->phys = PFN_PHYS(run->pfn + i);
+      res->kind = run->kind;
+      res->node = run->node;
+      res->zone = run->zone;
+    }
+  }
+  rs->n += take;
+  return take;
+}
+
+/*
+ * Translate pages [*cursor, end) into one result per page until cap
+ * results are written; *cursor is advanced past the last page written.
+ */
+size_t gfn_xlate_range(struct kvm *kvm, gfn_t *cursor, gfn_t end, u32 flags,
+                       struct gfn_xlate_result *out, size_t cap) {
+  struct gfn_result_sink rs = {
+      .sink.emit = gfn_result_emit,
+      .out = out,
+      .cap = cap,
+  };
+
+  *cursor = gfn_walk_range(kvm, *cursor, end, flags, &rs.sink);
+  return rs.n;
+}
+
+struct gfn_record_sink {
+  struct gfn_sink sink;
+  u64 *out;
+  size_t n, cap;
+};
+
+static unsigned long gfn_record_emit(struct gfn_sink *sink,
+                                     const struct gfn_run *run) {
+  struct gfn_record_sink *rs = container_of(sink, struct gfn_record_sink, sink);
+  unsigned long i, take = min_t(unsigned long, run->npages, rs->cap - rs->n);
+  u64 rec = 0;
+
+  if (run->hva)
+    rec |= GFN_MAP_SLOT;
+  if (!run->error)
+    rec |= GFN_MAP_PRESENT | ((u64)run->kind << GFN_MAP_KIND_SHIFT);
+
+  for (i = 0; i < take; i++)
+    rs->out[rs->n + i] =
+        run->error ? rec : rec | ((run->pfn + i) & GFN_MAP_PFN_MASK);
+  rs->n += take;
+  return take;
+}
+
+/*
+ * Encode pages [*cursor, end) as gfn_to_pfn_map records, like
+ * gfn_xlate_range() does results.
+ */
+size_t gfn_xlate_records(struct kvm *kvm, gfn_t *cursor, gfn_t end, u32 flags,
+                         u64 *out, size_t cap) {
+  struct gfn_record_sink rs = {
+      .sink.emit = gfn_record_emit,
+      .out = out,
+      .cap = cap,
+  };
+
+  *cursor = gfn_walk_range(kvm, *cursor, end, flags, &rs.sink);
+  return rs.n;
+}
+
+static unsigned long gfn_extent_emit(struct gfn_sink *sink,
+                                     const struct gfn_run *run) {
+  struct gfn_extent_sink *es = container_of(sink, struct gfn_extent_sink, sink);
+  struct gfn_extent *last = es->n ? &es->out[es->n - 1] : NULL;
+  u64 gpa = (u64)run->gfn << PAGE_SHIFT;
+  u64 hpa = run->error ? 0 : PFN_PHYS(run->pfn);
+  u64 len = (u64)run->npages << PAGE_SHIFT;
+
+  if (last && last->gpa_start + last->length == gpa &&
+      last->kind == run->kind && last->error == run->error &&
+      (run->error || last->hpa_start + last->length == hpa)) {
+    last->length += len;
+    return run->npages;
+  }
+
+  if (es->n == es->cap)
+    return 0;
+
+  last = &es->out[es->n++];
+  last->gpa_start = gpa;
+  last->hpa_start = hpa;
+  last->length = len;
+  last->kind = run->error ? GFN_KIND_NONE : run->kind;
+  last->error = run->error;
+  return run->npages;
+}
+
+/*
+ * Translate [gfn, end) into extents appended to es->out, merging a run into
+ * the last extent when both the guest and the host side continue it.
+ * Returns the first gfn that did not fit.
+ */
+gfn_t gfn_xlate_extents(struct kvm *kvm, gfn_t gfn, gfn_t end, u32 flags,
+                        struct gfn_extent_sink *es) {
+  es->sink.emit = gfn_extent_emit;
+  return gfn_walk_range(kvm, gfn, end, flags, &es->sink);
+}
+
+/*
+ * Close the growing segment: count it, and stage it while the caller
+ * still wants segments. False if it has to be staged but out is full.
+ */
+bool gfn_contig_close(struct gfn_contig_sink *cs) {
+  if (!cs->cur.length)
+    return true;
+  if (cs->n < cs->left) {
+    if (cs->n == cs->cap)
+      return false;
+    cs->out[cs->n++] = cs->cur;
+  }
+  cs->nr++;
+  if (cs->cur.length > cs->largest.length)
+    cs->largest = cs->cur;
+  cs->cur.length = 0;
+  return true;
+}
+
+static unsigned long gfn_contig_emit(struct gfn_sink *sink,
+                                     const struct gfn_run *run) {
+  struct gfn_contig_sink *cs = container_of(sink, struct gfn_contig_sink, sink);
+  struct gfn_extent *cur = &cs->cur;
+  u64 gpa = (u64)run->gfn << PAGE_SHIFT;
+  u64 len = (u64)run->npages << PAGE_SHIFT;
+  u64 hpa = PFN_PHYS(run->pfn);
+
+  if (!run->error && cur->length && cur->gpa_start + cur->length == gpa &&
+      cur->hpa_start + cur->length == hpa) {
+    cur->length += len;
+    return run->npages;
+  }
+
+  /* Unbacked pages end a segment and start none. */
+  if (!gfn_contig_close(cs))
+    return 0;
+  if (run->error) {
+    cs->unbacked += run->npages;
+    return run->npages;
+  }
+
+  cur->gpa_start = gpa;
+  cur->hpa_start = hpa;
+  cur->length = len;
+  cur->kind = run->kind;
+  cur->error = 0;
+  return run->npages;
+}
+
+/*
+ * Cut [gfn, end) into host-physically contiguous segments in one walk. A
+ * huge mapping arrives as one run in the walk mode, so only the seams
+ * between mappings are compared. The last segment stays open for the
+ * next window; close it with gfn_contig_close() at the end. Returns the
+ * first gfn not consumed, short of end when out filled up.
+ */
+gfn_t gfn_xlate_contig(struct kvm *kvm, gfn_t gfn, gfn_t end, u32 flags,
+                       struct gfn_contig_sink *cs) {
+  cs->sink.emit = gfn_contig_emit;
+  return gfn_walk_range(kvm, gfn, end, flags, &cs->sink);
+}
+
+static unsigned long gfn_access_emit(struct gfn_sink *sink,
+                                     const struct gfn_run *run) {
+  struct gfn_access_sink *as = container_of(sink, struct gfn_access_sink, sink);
+  unsigned long take = min_t(unsigned long, run->npages, as->cap - as->n);
+
+  if (!run->error && take) {
+    as->nr_present += take;
+    if (run->young) {
+      bitmap_set(as->young, as->n, take);
+      as->nr_young += take;
+    }
+    if (run->dirty) {
+      bitmap_set(as->dirty, as->n, take);
+      as->nr_dirty += take;
+    }
+  }
+  as->n += take;
+  return take;
+}
+
+static unsigned long gfn_access_room(struct gfn_sink *sink) {
+  struct gfn_access_sink *as = container_of(sink, struct gfn_access_sink, sink);
+
+  return as->cap - as->n;
+}
+
+/*
+ * Sample accessed and dirty bits for [gfn, end) into as, one bit per page
+ * from bit as->n on, walking (and with clear, resetting) each mapping once.
+ * Returns the first gfn that did not fit.
+ */
+gfn_t gfn_xlate_access(struct kvm *kvm, gfn_t gfn, gfn_t end, bool clear,
+                       struct gfn_access_sink *as) {
+  u32 flags = GFN_XLATE_NOFAULT | GFN_WALK_YOUNG;
+
+  if (clear)
+    flags |= GFN_WALK_CLEAR_YOUNG;
+  as->sink.emit = gfn_access_emit;
+  as->sink.room = gfn_access_room;
+  return gfn_walk_range(kvm, gfn, end, flags, &as->sink);
+}
@@ -0,0 +1,125 @@
+#ifndef GFN_XLATE_H
+#define GFN_XLATE_H
+
+#include <linux/kvm_host.h>
+
+#include "gfn_ioctl.h"
+
+struct gfn_vm;
+
+/* Pages pinned per get_user_pages_remote() call while walking a range. */
+#define GFN_GUP_CHUNK 64
+/* Results staged in kernel memory between copies to userspace. */
+#define GFN_RANGE_STAGE 65536
+#define GFN_EXTENT_STAGE 4096
+#define GFN_MAP_STAGE 65536
+/*
+ * Pages per accessed/dirty batch: a multiple of 64, and a whole 1G mapping
+ * so an aligned huge page is never cleared in one batch and reported in
+ * the next.
+ */
+#define GFN_ACCESS_STAGE (PUD_SIZE >> PAGE_SHIFT)
+
+/*
+ * Walk flags for gfn_walk_range() with GFN_XLATE_NOFAULT, kept clear of the
+ * GFN_XLATE_* bits: report accessed bits including secondary MMUs, and
+ * test-and-clear them instead of just reading.
+ */
+#define GFN_WALK_YOUNG (1U << 30)
+#define GFN_WALK_CLEAR_YOUNG (1U << 31)
+
+/* What gfn_walk_hva() found mapped at an address. */
+struct gfn_walk {
+  unsigned long pfn;  /* pfn of the 4K page containing the address */
+  unsigned long size; /* mapping size, or span of the empty entry */
+  u32 kind;
+  bool young, dirty; /* host page table bits */
+};
+
+/*
+ * A run of npages guest pages translated in one step: gfn + i is backed by
+ * pfn + i. Error runs (no memslot, not present, GUP failure) carry no pfn.
+ */
+struct gfn_run {
+  gfn_t gfn;
+  unsigned long hva;
+  unsigned long npages;
+  unsigned long pfn;
+  u32 kind;
+  s32 node;
+  u32 zone;
+  int error;
+  unsigned long map_size; /* walk mode only: size of the mapping */
+  bool young, dirty;      /* walk mode only */
+};
+
+/*
+ * Consumer of gfn_walk_range(); emit returns the pages taken, 0 when full.
+ * room, if set, returns how many more pages the sink can take; the walk
+ * asks about no more than that, so it never clears accessed bits on pages
+ * that would not be reported.
+ */
+struct gfn_sink {
+  unsigned long (*emit)(struct gfn_sink *sink, const struct gfn_run *run);
+  unsigned long (*room)(struct gfn_sink *sink);
+};
+
+struct gfn_extent_sink {
+  struct gfn_sink sink;
+  struct gfn_extent *out;
+  size_t n, cap;
+};
+
+/* Accessed/dirty bitmaps for cap pages starting at the first gfn walked. */
+struct gfn_access_sink {
+  struct gfn_sink sink;
+  unsigned long *young, *dirty;
+  size_t n, cap;
+  u64 nr_present, nr_young, nr_dirty;
+};
+
+/*
+ * Host-physically contiguous segments of a guest range. Segments are
+ * counted and measured as they close; the first left of them are staged
+ * in out, cap at a time.
+ */
+struct gfn_contig_sink {
+  struct gfn_sink sink;
+  struct gfn_extent cur; /* segment still growing; length 0 if none */
+  struct gfn_extent *out;
+  size_t n, cap;
+  u64 left;
+  u64 nr, unbacked;
+  struct gfn_extent largest;
+};
+
+extern const char *const gfn_kind_names[];
+
+void gfn_page_place(unsigned long pfn, s32 *node, u32 *zone);
+const char *gfn_zone_name(s32 node, u32 zone);
+
+long gfn_to_hva_safe(struct kvm *kvm, unsigned long full_gfn,
+                     unsigned long *out_hva);
+long gfn_xlate_page(struct mm_struct *mm, struct gfn_xlate_result *res);
+int gfn_walk_hva(struct mm_struct *mm, unsigned long addr, u32 flags,
+                 struct gfn_walk *w);
+int gfn_xlate_walk(struct mm_struct *mm, struct gfn_xlate_result *res);
+void gfn_xlate_one(struct kvm *kvm, struct gfn_vm *vm,
+                   const struct gfn_xlate_req *req,
+                   struct gfn_xlate_result *res);
+gfn_t gfn_walk_range(struct kvm *kvm, gfn_t gfn, gfn_t end, u32 flags,
+                     struct gfn_sink *sink);
+size_t gfn_xlate_range(struct kvm *kvm, gfn_t *cursor, gfn_t end, u32 flags,
+                       struct gfn_xlate_result *out, size_t cap);
+size_t gfn_xlate_records(struct kvm *kvm, gfn_t *cursor, gfn_t end, u32 flags,
+                         u64 *out, size_t cap);
+
+gfn_t gfn_xlate_extents(struct kvm *kvm, gfn_t gfn, gfn_t end, u32 flags,
+                        struct gfn_extent_sink *es);
+gfn_t gfn_xlate_contig(struct kvm *kvm, gfn_t gfn, gfn_t end, u32 flags,
+                       struct gfn_contig_sink *cs);
+bool gfn_contig_close(struct gfn_contig_sink *cs);
+gfn_t gfn_xlate_access(struct kvm *kvm, gfn_t gfn, gfn_t end, bool clear,
+                       struct gfn_access_sink *as);
+
+#endif /* GFN_XLATE_H */
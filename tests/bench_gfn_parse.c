@@ -0,0 +1,65 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../gfn_parse.h"
+
+/*
+ * Parse a generated request stream the way gfn_write() sees it: lines of
+ * GFNS_PER_LINE hex GFNs, delivered in WRITE_SIZE pieces that cut tokens
+ * at arbitrary points.
+ */
+#define GFNS_PER_LINE 64
+#define WRITE_SIZE 4096
+#define ROUNDS 20
+
+static unsigned long total_gfns;
+
+static int count_line(void *arg, const struct gfn_line *line) {
+  (void)arg;
+  total_gfns += line->nr;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t lines = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+  size_t cap = lines * (GFNS_PER_LINE * 20 + 32), len = 0, off, i, j;
+  struct gfn_stream s;
+  struct timespec t0, t1;
+  char *buf = malloc(cap);
+  double ns;
+  int r;
+
+  if (!buf) {
+    perror("malloc");
+    return 1;
+  }
+  srand(1);
+  for (i = 0; i < lines; i++) {
+    for (j = 0; j < GFNS_PER_LINE; j++)
+      len += sprintf(buf + len, "0x%lx ",
+                     ((unsigned long)rand() << 12) | (rand() & 0xfff));
+    len += sprintf(buf + len, "pid=4242 tag=%zu\n", i);
+  }
+
+  gfn_stream_init(&s);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (r = 0; r < ROUNDS; r++) {
+    for (off = 0; off < len; off += WRITE_SIZE) {
+      size_t n = len - off < WRITE_SIZE ? len - off : WRITE_SIZE, used;
+
+      gfn_stream_feed(&s, buf + off, n, &used, count_line, NULL);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  gfn_stream_destroy(&s);
+
+  ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  printf("%lu gfns, %.1f MB in %.3f s: %.1f ns/gfn, %.0f MB/s\n", total_gfns,
+         (double)len * ROUNDS / 1e6, ns / 1e9, ns / total_gfns,
+         (double)len * ROUNDS / 1e6 / (ns / 1e9));
+  free(buf);
+  return 0;
+}
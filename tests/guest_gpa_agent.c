@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Guest side of the lookup protocol for whole address ranges. Resolves
+ * the VA ranges of a target process to GPAs through its pagemap (one fd,
+ * one pread() per range), sends the present pages to the host server in
+ * batched lines, and prints a VA -> GPA -> HPA table from the replies.
+ *
+ *     guest_gpa_agent [--port N] [--vm PID] <host_ip> <pid> --heap
+ *     guest_gpa_agent <host_ip> <pid> 0x7f0000000000-0x7f0000400000 ...
+ *
+ * Reading another process's pagemap needs CAP_SYS_ADMIN for the PFNs.
+ */
+
+#define PORT 12345
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+
+#define PM_PRESENT (1ULL << 63)
+#define PM_PFN_MASK ((1ULL << 55) - 1)
+
+/*
+ * GPAs per request line. The server takes up to 4096, but a line must
+ * also fit its 64 KiB input buffer; 1024 "0x..." GPAs stay well inside.
+ */
+#define BATCH_MAX 1024
+/* Pagemap entries per pread(); larger ranges take one read per chunk. */
+#define PREAD_MAX (1UL << 20)
+#define REPLY_LINE_MAX 256
+
+struct range {
+    uint64_t start, end;
+};
+
+struct page {
+    uint64_t va, gpa;
+};
+
+struct agent {
+    int pagemap;
+    int sock;
+    uint64_t vm_pid;
+    char in[4096];
+    size_t in_len, in_off;
+    struct page batch[BATCH_MAX];
+    size_t nr;
+    unsigned long pages, present, ok;
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--port N] [--vm VM_PID] <host_ip> <pid> "
+            "(--heap | <start>-<end>...)\n",
+            prog);
+}
+
+/* The [heap] mapping of pid, from its maps file. */
+static int find_heap(pid_t pid, struct range *r) {
+    char path[64], line[512];
+    FILE *f;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    while (!found && fgets(line, sizeof(line), f)) {
+        unsigned long long start, end;
+
+        if (strstr(line, "[heap]") &&
+            sscanf(line, "%llx-%llx", &start, &end) == 2) {
+            r->start = start;
+            r->end = end;
+            found = 1;
+        }
+    }
+    fclose(f);
+    if (!found)
+        fprintf(stderr, "pid %d has no [heap] mapping\n", pid);
+    return found ? 0 : -1;
+}
+
+static int parse_range(const char *arg, struct range *r) {
+    unsigned long long start, end;
+    char *p;
+
+    errno = 0;
+    start = strtoull(arg, &p, 0);
+    if (errno || *p != '-')
+        return -1;
+    end = strtoull(p + 1, &p, 0);
+    if (errno || *p || end <= start)
+        return -1;
+    r->start = start & ~(PAGE_SIZE - 1);
+    r->end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    return 0;
+}
+
+static int connect_host(const char *ip, int port) {
+    struct sockaddr_in addr = {0};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0) {
+        fprintf(stderr, "bad host address %s\n", ip);
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Next reply line from the server, without its newline. */
+static int read_line(struct agent *a, char *line, size_t cap) {
+    size_t len = 0;
+
+    for (;;) {
+        while (a->in_off < a->in_len) {
+            char c = a->in[a->in_off++];
+
+            if (c == '\n') {
+                line[len] = '\0';
+                return 0;
+            }
+            if (len + 1 < cap)
+                line[len++] = c;
+        }
+
+        ssize_t n = read(a->sock, a->in, sizeof(a->in));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "server closed the connection\n");
+            return -1;
+        }
+        a->in_len = n;
+        a->in_off = 0;
+    }
+}
+
+static const char *field(const char *line, const char *key, char *out,
+                         size_t cap) {
+    const char *p = strstr(line, key);
+    size_t n = 0;
+
+    if (!p)
+        return "-";
+    p += strlen(key);
+    while (p[n] && p[n] != ' ' && n + 1 < cap) {
+        out[n] = p[n];
+        n++;
+    }
+    out[n] = '\0';
+    return out;
+}
+
+static void print_row(struct agent *a, const struct page *pg,
+                      const char *reply) {
+    char phys[32], kind[16], node[16], zone[16];
+
+    if (strncmp(reply, "ok ", 3)) {
+        printf("0x%016" PRIx64 "  0x%012" PRIx64 "  %s\n", pg->va, pg->gpa,
+               reply);
+        return;
+    }
+    a->ok++;
+    printf("0x%016" PRIx64 "  0x%012" PRIx64 "  %-14s  %-7s  %4s  %s\n",
+           pg->va, pg->gpa, field(reply, "phys=", phys, sizeof(phys)),
+           field(reply, "kind=", kind, sizeof(kind)),
+           field(reply, "node=", node, sizeof(node)),
+           field(reply, "zone=", zone, sizeof(zone)));
+}
+
+/* Send the pending batch as one line and print its replies in order. */
+static int flush_batch(struct agent *a) {
+    static char line[BATCH_MAX * 20 + 32];
+    char reply[REPLY_LINE_MAX];
+    size_t len = 0, i;
+
+    if (!a->nr)
+        return 0;
+    for (i = 0; i < a->nr; i++)
+        len += snprintf(line + len, sizeof(line) - len, "0x%" PRIx64 " ",
+                        a->batch[i].gpa);
+    if (a->vm_pid)
+        len += snprintf(line + len, sizeof(line) - len, "pid=%" PRIu64,
+                        a->vm_pid);
+    line[len++] = '\n';
+    if (write_all(a->sock, line, len))
+        return -1;
+
+    for (i = 0; i < a->nr; i++) {
+        if (read_line(a, reply, sizeof(reply)))
+            return -1;
+        print_row(a, &a->batch[i], reply);
+    }
+    a->nr = 0;
+    return 0;
+}
+
+/*
+ * Resolve [r->start, r->end) with one pread() of its pagemap entries
+ * (per PREAD_MAX pages), queueing every present page for the host.
+ */
+static int scan_range(struct agent *a, const struct range *r, uint64_t *pm) {
+    uint64_t va = r->start;
+
+    while (va < r->end) {
+        size_t want = (r->end - va) >> PAGE_SHIFT, got, i;
+        ssize_t n;
+
+        if (want > PREAD_MAX)
+            want = PREAD_MAX;
+        n = pread(a->pagemap, pm, want * sizeof(*pm),
+                  (va >> PAGE_SHIFT) * sizeof(*pm));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("pread pagemap");
+            return -1;
+        }
+        got = n / sizeof(*pm);
+        if (!got)
+            break;
+
+        for (i = 0; i < got; i++, va += PAGE_SIZE) {
+            a->pages++;
+            if (!(pm[i] & PM_PRESENT))
+                continue;
+            if (!(pm[i] & PM_PFN_MASK)) {
+                fprintf(stderr, "pagemap hides PFNs; run as root\n");
+                return -1;
+            }
+            a->present++;
+            a->batch[a->nr].va = va;
+            a->batch[a->nr].gpa = (pm[i] & PM_PFN_MASK) << PAGE_SHIFT;
+            if (++a->nr == BATCH_MAX && flush_batch(a))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const struct option opts[] = {
+        {"heap", no_argument, NULL, 'h'},
+        {"port", required_argument, NULL, 'p'},
+        {"vm", required_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0},
+    };
+    static struct agent a;
+    struct range *ranges;
+    int heap = 0, port = PORT, nr = 0, opt, i, rc = 1;
+    char path[64];
+    uint64_t *pm;
+    pid_t pid;
+
+    while ((opt = getopt_long(argc, argv, "hp:v:", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            heap = 1;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'v':
+            a.vm_pid = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2 || (!heap && argc - optind < 3)) {
+        usage(argv[0]);
+        return 1;
+    }
+    pid = atoi(argv[optind + 1]);
+
+    ranges = calloc(argc - optind - 2 + heap, sizeof(*ranges));
+    pm = malloc(PREAD_MAX * sizeof(*pm));
+    if (!ranges || !pm) {
+        perror("malloc");
+        return 1;
+    }
+    if (heap && find_heap(pid, &ranges[nr++]))
+        return 1;
+    for (i = optind + 2; i < argc; i++) {
+        if (parse_range(argv[i], &ranges[nr++])) {
+            fprintf(stderr, "bad range %s (want <start>-<end>)\n", argv[i]);
+            return 1;
+        }
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/pagemap", pid);
+    a.pagemap = open(path, O_RDONLY | O_CLOEXEC);
+    if (a.pagemap < 0) {
+        perror(path);
+        return 1;
+    }
+    a.sock = connect_host(argv[optind], port);
+    if (a.sock < 0)
+        return 1;
+
+    printf("%-18s  %-14s  %-14s  %-7s  %4s  %s\n", "VA", "GPA", "HPA", "KIND",
+           "NODE", "ZONE");
+    for (i = 0; i < nr; i++) {
+        if (scan_range(&a, &ranges[i], pm))
+            goto out;
+    }
+    if (flush_batch(&a))
+        goto out;
+    rc = 0;
+
+out:
+    fprintf(stderr, "pages=%lu present=%lu ok=%lu\n", a.pages, a.present,
+            a.ok);
+    close(a.sock);
+    close(a.pagemap);
+    free(pm);
+    free(ranges);
+    return rc;
+}
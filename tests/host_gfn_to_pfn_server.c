@@ -1,136 +1,422 @@
 #define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <fcntl.h>
+#include <unistd.h>
+
+#include "../gfn_ioctl.h"
+
+/*
+ * Host side of the guest lookup protocol. Guests keep a TCP connection
+ * open and send lines of the form
+ *
+ *     <gpa> [<gpa> ...] [pid=<vm_pid>]\n
+ *
+ * and get back one line per GPA, in order, using the module's text reply
+ * format ("ok phys=0x... kind=... gpa=0x... hva=0x... node=N zone=..." or
+ * "err:..."). Errors are per GPA too, so clients can count replies.
+ * Every line is translated with one GFN_IOC_XLATE_BATCH per GPAS_PER_BATCH
+ * GPAs on one proc fd that stays open for the life of the server.
+ */
 
 #define PORT 12345
 #define PROC_PATH "/proc/gfn_to_pfn"
+#define MAX_EVENTS 64
+#define IN_BUF_SIZE 65536
+#define GPAS_PER_BATCH 4096
+#define REPLY_LINE_MAX 160
+
+struct conn {
+    int fd;
+    char in[IN_BUF_SIZE];
+    size_t in_len;
+    int discarding; /* dropping the rest of an overlong line */
+    int eof;        /* peer finished sending; close once out is flushed */
+    char *out;
+    size_t out_len, out_off, out_cap;
+};
+
+static const char *const kind_names[] = {
+    [GFN_KIND_NONE] = "none",
+    [GFN_KIND_BASE] = "base",
+    [GFN_KIND_THP] = "thp",
+    [GFN_KIND_HUGETLB] = "hugetlb",
+};
+
+/*
+ * Zone names for the usual x86-64 layout (ZONE_DMA, ZONE_DMA32,
+ * ZONE_NORMAL, ZONE_MOVABLE); the index depends on the host config, so
+ * anything else is printed as a number.
+ */
+static const char *const zone_names[] = {"DMA", "DMA32", "Normal", "Movable"};
+
+static const char *zone_name(const struct gfn_xlate_result *r) {
+    static char buf[16];
+
+    if (r->node == GFN_NODE_NONE)
+        return "none";
+    if (r->zone < sizeof(zone_names) / sizeof(zone_names[0]))
+        return zone_names[r->zone];
+    snprintf(buf, sizeof(buf), "%u", r->zone);
+    return buf;
+}
+
+static int proc_fd = -1;
+static int epfd = -1;
+static struct gfn_xlate_req reqs[GPAS_PER_BATCH];
+static struct gfn_xlate_result results[GPAS_PER_BATCH];
+
+static int out_reserve(struct conn *c, size_t extra) {
+    if (c->out_len + extra <= c->out_cap)
+        return 0;
+
+    size_t cap = c->out_cap ? c->out_cap : 4096;
+    while (cap < c->out_len + extra)
+        cap *= 2;
+    char *p = realloc(c->out, cap);
+    if (!p)
+        return -1;
+    c->out = p;
+    c->out_cap = cap;
+    return 0;
+}
+
+static int out_printf(struct conn *c, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static int out_printf(struct conn *c, const char *fmt, ...) {
+    va_list ap;
+
+    if (out_reserve(c, REPLY_LINE_MAX))
+        return -1;
+    va_start(ap, fmt);
+    int n = vsnprintf(c->out + c->out_len, REPLY_LINE_MAX, fmt, ap);
+    va_end(ap);
+    if (n >= REPLY_LINE_MAX)
+        n = REPLY_LINE_MAX - 1;
+    c->out_len += n;
+    return 0;
+}
 
-void read_dmesg_for_hpa(char *hpa_buf, size_t size, const char *gpa_str) {
-    if (!hpa_buf || !gpa_str || size == 0) {
-        fprintf(stderr, "Invalid arguments\n");
-        return;
+/* Translate reqs[0..count) and append one reply per request to c->out. */
+static int xlate_batch(struct conn *c, unsigned long long vm_pid,
+                       unsigned int count) {
+    struct gfn_xlate_batch batch = {
+        .vm_pid = vm_pid,
+        .reqs = (uintptr_t)reqs,
+        .results = (uintptr_t)results,
+        .count = count,
+    };
+    if (ioctl(proc_fd, GFN_IOC_XLATE_BATCH, &batch) < 0) {
+        int err = errno;
+        for (unsigned int i = 0; i < count; i++) {
+            int rc;
+            if (err == ESRCH)
+                rc = out_printf(c, "err:no_vm pid=%llu\n", vm_pid);
+            else if (err == ENODEV)
+                rc = out_printf(c, "err:no_vms\n");
+            else
+                rc = out_printf(c, "err:ioctl=%d\n", -err);
+            if (rc)
+                return rc;
+        }
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        const struct gfn_xlate_result *r = &results[i];
+        int rc;
+
+        if (r->error == -EFAULT)
+            rc = out_printf(c, "err:hva gfn=0x%llx\n",
+                            (unsigned long long)r->gpa);
+        else if (r->error)
+            rc = out_printf(c, "err:gup=%d\n", r->error);
+        else
+            rc = out_printf(c,
+                            "ok phys=0x%llx kind=%s gpa=0x%llx hva=0x%llx "
+                            "node=%d zone=%s\n",
+                            (unsigned long long)r->phys,
+                            r->kind <= GFN_KIND_HUGETLB ? kind_names[r->kind]
+                                                        : "?",
+                            (unsigned long long)r->gpa,
+                            (unsigned long long)r->hva, r->node,
+                            zone_name(r));
+        if (rc)
+            return rc;
+    }
+    return 0;
+}
+
+/*
+ * Translate one request line and append the replies to c->out, one per
+ * GPA whatever happens. The line is checked whole first, so pid= can come
+ * anywhere and a bad token fails every GPA on the line. Long lines go out
+ * in several batches.
+ */
+static int handle_line(struct conn *c, char *line) {
+    char *p = line, *stop = line + strlen(line), *save = NULL, *tok, *end;
+    unsigned long long vm_pid = 0;
+    unsigned int count = 0, ngpas = 0;
+    int bad = 0, rc;
+
+    for (tok = strtok_r(line, " \t\r", &save); tok;
+         tok = strtok_r(NULL, " \t\r", &save)) {
+        errno = 0;
+        if (!strncmp(tok, "pid=", 4)) {
+            vm_pid = strtoull(tok + 4, &end, 0);
+            if (errno || *end || end == tok + 4)
+                bad = 1;
+            continue;
+        }
+        strtoull(tok, &end, 16);
+        if (errno || *end || end == tok)
+            bad = 1;
+        ngpas++;
+    }
+    if (bad) {
+        do {
+            rc = out_printf(c, "err:invalid_input\n");
+        } while (!rc && ngpas-- > 1);
+        return rc;
     }
 
-    FILE *fp = popen("sudo dmesg | tail -n 50", "r");
-    if (!fp) {
-        perror("popen failed");
-        return;
+    /* strtok_r() left each token NUL-terminated in place. */
+    while (p < stop) {
+        if (!*p || *p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+            continue;
+        }
+        tok = p;
+        p += strlen(p);
+        if (!strncmp(tok, "pid=", 4))
+            continue;
+
+        reqs[count].gfn = strtoull(tok, NULL, 16);
+        reqs[count].flags = 0;
+        reqs[count].reserved = 0;
+        if (++count == GPAS_PER_BATCH) {
+            rc = xlate_batch(c, vm_pid, count);
+            if (rc)
+                return rc;
+            count = 0;
+        }
     }
+    return count ? xlate_batch(c, vm_pid, count) : 0;
+}
 
-    char line[512];
-    char cleaned_gpa[64];
+static void conn_close(struct conn *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
 
-    // Clean newline characters from gpa_str
-    strncpy(cleaned_gpa, gpa_str, sizeof(cleaned_gpa) - 1);
-    cleaned_gpa[sizeof(cleaned_gpa) - 1] = '\0';
-    char *newline = strpbrk(cleaned_gpa, "\r\n");
-    if (newline) *newline = '\0';
+/* Returns -1 on a fatal socket error, 1 if output is still pending. */
+static int conn_flush(struct conn *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+    return 0;
+}
 
-    char match_prefix[128];
-    snprintf(match_prefix, sizeof(match_prefix), "exact phys addr for gpa %s:", cleaned_gpa);
+static void conn_want_write(struct conn *c, int on) {
+    struct epoll_event ev = {
+        .events = (c->eof ? 0 : EPOLLIN | EPOLLRDHUP) | (on ? EPOLLOUT : 0),
+        .data.ptr = c,
+    };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
 
-    while (fgets(line, sizeof(line), fp)) {
-        if (strstr(line, match_prefix)) {
-            char *colon = strchr(line, ':');
-            if (colon) {
-                while (*colon == ':' || *colon == ' ') colon++;
-                strncpy(hpa_buf, colon, size - 1);
-                hpa_buf[size - 1] = '\0';
-                // Strip trailing newline
-                char *nl = strchr(hpa_buf, '\n');
-                if (nl) *nl = '\0';
+/* Consume every complete line in the input buffer. */
+static int conn_process(struct conn *c) {
+    size_t start = 0;
+
+    for (size_t i = 0; i < c->in_len; i++) {
+        if (c->in[i] != '\n')
+            continue;
+        c->in[i] = '\0';
+        if (c->discarding)
+            c->discarding = 0;
+        else if (handle_line(c, c->in + start))
+            return -1;
+        start = i + 1;
+    }
+
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+
+    if (c->in_len == sizeof(c->in)) {
+        c->in_len = 0;
+        if (!c->discarding && out_printf(c, "err:line_too_long\n"))
+            return -1;
+        c->discarding = 1;
+    }
+    return 0;
+}
+
+/* Returns -1 when the connection should be closed. */
+static int conn_readable(struct conn *c) {
+    for (;;) {
+        ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
                 break;
-            }
+            return -1;
+        }
+        if (n == 0) {
+            c->eof = 1;
+            break;
         }
+        c->in_len += n;
+        if (conn_process(c))
+            return -1;
     }
 
-    pclose(fp);
+    int pending = conn_flush(c);
+    if (pending < 0 || (c->eof && !pending))
+        return -1;
+    conn_want_write(c, pending);
+    return 0;
 }
 
-int main() {
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
+static void accept_all(int server_fd) {
+    for (;;) {
+        int fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            if (errno == EINTR)
+                continue;
+            return;
+        }
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
+        struct conn *c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLRDHUP,
+            .data.ptr = c,
+        };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(fd);
+            free(c);
+        }
     }
+}
 
+int main(int argc, char *argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : PORT;
+    struct sockaddr_in address = {0};
     int opt = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    proc_fd = open(PROC_PATH, O_RDWR | O_CLOEXEC);
+    if (proc_fd < 0) {
+        perror("open " PROC_PATH);
+        exit(EXIT_FAILURE);
+    }
+
+    int server_fd =
+        socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0) {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    address.sin_port = htons(port);
 
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
         perror("bind failed");
         exit(EXIT_FAILURE);
     }
-
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
 
-    printf("Host server listening on port %d...\n", PORT);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
 
-    while (1) {
-        new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-        if (new_socket < 0) {
-            perror("accept");
-            continue;
-        }
+    printf("Host server listening on port %d...\n", port);
 
-        char buffer[64] = {0};
-        ssize_t valread = read(new_socket, buffer, sizeof(buffer) - 1);
-        if (valread <= 0) {
-            close(new_socket);
-            continue;
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
         }
-        buffer[valread] = '\0';
 
-        printf("Received GPA from guest: %s", buffer);
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
 
-        // Write GPA to /proc/gfn_to_pfn
-        int f = open(PROC_PATH, O_WRONLY);
-        if (f < 0) {
-            perror("open /proc/gfn_to_pfn");
-            const char *err = "Error: cannot open /proc/gfn_to_pfn\n";
-            write(new_socket, err, strlen(err));
-            close(new_socket);
-            continue;
-        }
-        if (write(f, buffer, strlen(buffer)) < 0) {
-            perror("write /proc/gfn_to_pfn");
-            const char *err = "Error: write failed\n";
-            write(new_socket, err, strlen(err));
-            close(f);
-            close(new_socket);
-            continue;
+            if (!c) {
+                accept_all(server_fd);
+                continue;
+            }
+            if (events[i].events & EPOLLERR) {
+                conn_close(c);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                int pending = conn_flush(c);
+                if (pending < 0 || (c->eof && !pending)) {
+                    conn_close(c);
+                    continue;
+                }
+                conn_want_write(c, pending);
+            }
+            if (!c->eof &&
+                (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+                if (conn_readable(c))
+                    conn_close(c);
+            }
         }
-        close(f);
-
-        // Read dmesg for HPA info
-        char hpa_msg[256] = {0};
-        read_dmesg_for_hpa(hpa_msg, sizeof(hpa_msg), buffer);
-        printf("HPA: %s\n", hpa_msg);
-
-        // Send HPA back to guest
-        write(new_socket, hpa_msg, strlen(hpa_msg));
-
-        close(new_socket);
     }
 
+    close(epfd);
     close(server_fd);
+    close(proc_fd);
     return 0;
 }
-
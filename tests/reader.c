@@ -4,35 +4,68 @@
 #include <unistd.h>
 #include <stdint.h>
 
+#define MEM_PATH "/proc/gfn_to_pfn_mem/%s"
+#define CHUNK (1 << 20)
+
+/*
+ * Read guest memory of a VM by GPA through the module's per-VM memory
+ * file. One byte is printed in decimal, more as a hex dump.
+ */
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <physical_address>\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <vm_pid> <guest_physical_address> [bytes]\n",
+                argv[0]);
         return EXIT_FAILURE;
     }
 
-    unsigned long physical_address = strtoul(argv[1], NULL, 0);
+    unsigned long long gpa = strtoull(argv[2], NULL, 0);
+    size_t len = argc == 4 ? strtoul(argv[3], NULL, 0) : 1;
+    char path[64];
 
-    int fd = open("/dev/mem", O_RDONLY);
+    snprintf(path, sizeof(path), MEM_PATH, argv[1]);
+    int fd = open(path, O_RDONLY);
     if (fd == -1) {
-        perror("Failed to open /dev/mem");
+        perror(path);
         return EXIT_FAILURE;
     }
 
-    if (lseek(fd, physical_address, SEEK_SET) == (off_t)-1) {
-        perror("Failed to seek to physical address");
+    unsigned char *buf = malloc(CHUNK);
+    if (!buf) {
+        perror("malloc");
         close(fd);
         return EXIT_FAILURE;
     }
 
-    unsigned char value;
-    if (read(fd, &value, sizeof(value)) != sizeof(value)) {
-        perror("Failed to read value at physical address");
-        close(fd);
-        return EXIT_FAILURE;
-    }
+    size_t done = 0;
+    while (done < len) {
+        size_t want = len - done < CHUNK ? len - done : CHUNK;
+        ssize_t n = pread(fd, buf, want, gpa + done);
+
+        if (n <= 0) {
+            if (n < 0)
+                perror("Failed to read guest memory");
+            else
+                fprintf(stderr, "short read at 0x%llx\n", gpa + done);
+            free(buf);
+            close(fd);
+            return EXIT_FAILURE;
+        }
 
-    printf("%u\n", value);
+        if (len == 1) {
+            printf("%u\n", buf[0]);
+        } else {
+            for (ssize_t i = 0; i < n; i++) {
+                if ((done + i) % 16 == 0)
+                    printf("%s%012llx:", done + i ? "\n" : "", gpa + done + i);
+                printf(" %02x", buf[i]);
+            }
+        }
+        done += n;
+    }
+    if (len > 1)
+        printf("\n");
 
+    free(buf);
     close(fd);
     return 0;
 }
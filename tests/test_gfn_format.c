@@ -0,0 +1,150 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../gfn_format.h"
+#include "../gfn_ioctl.h"
+
+static struct gfn_record result(void) {
+  struct gfn_record rec = {
+      .version = GFN_RECORD_VERSION,
+      .size = sizeof(rec),
+      .type = GFN_RECORD_RESULT,
+      .kind = GFN_KIND_THP,
+      .node = 1,
+      .zone = 2,
+      .vm_pid = 4242,
+      .gpa = 0x1234,
+      .phys = 0x1ad725234,
+      .hva = 0x7f0000001234,
+  };
+  return rec;
+}
+
+static void expect(enum gfn_format fmt, const struct gfn_record *rec,
+                   const char *want) {
+  char buf[256];
+  size_t n = gfn_format_record(buf, sizeof(buf), fmt, rec, "Normal");
+
+  if (n != strlen(want) || memcmp(buf, want, n)) {
+    fprintf(stderr, "format %d: expected '%s' but got '%.*s'\n", fmt, want,
+            (int)n, buf);
+    assert(0);
+  }
+}
+
+/* The text form must stay byte for byte what the module always sent. */
+static void test_text(void) {
+  struct gfn_record rec = result();
+
+  expect(GFN_FORMAT_TEXT, &rec,
+         "ok phys=0x1ad725234 kind=thp gpa=0x1234 hva=0x7f0000001234 "
+         "node=1 zone=Normal\n");
+
+  rec.flags = GFN_RECORD_HAS_TAG;
+  rec.tag = 7;
+  rec.err = GFN_RECORD_ERR_HVA;
+  expect(GFN_FORMAT_TEXT, &rec, "err:hva gfn=0x1234 tag=7\n");
+
+  rec.flags = 0;
+  rec.err = GFN_RECORD_ERR_GUP;
+  rec.error = -14;
+  expect(GFN_FORMAT_TEXT, &rec, "err:gup=-14\n");
+  rec.err = GFN_RECORD_ERR_NO_VM;
+  expect(GFN_FORMAT_TEXT, &rec, "err:no_vm pid=4242\n");
+  rec.err = GFN_RECORD_ERR_NO_VMS;
+  expect(GFN_FORMAT_TEXT, &rec, "err:no_vms\n");
+  rec.err = GFN_RECORD_ERR_INPUT;
+  expect(GFN_FORMAT_TEXT, &rec, "err:invalid_input\n");
+
+  rec = result();
+  rec.type = GFN_RECORD_INVAL;
+  rec.gpa = 0x100200000;
+  rec.npages = 512;
+  rec.cookie = 7;
+  expect(GFN_FORMAT_TEXT, &rec,
+         "event:inval pid=4242 gpa=0x100200000 npages=512 cookie=7\n");
+  rec.type = GFN_RECORD_OVERFLOW;
+  rec.cookie = 3;
+  expect(GFN_FORMAT_TEXT, &rec, "event:overflow lost=3\n");
+}
+
+static void test_csv(void) {
+  struct gfn_record rec = result();
+  char buf[256];
+  size_t n;
+
+  n = gfn_format_header(buf, sizeof(buf), GFN_FORMAT_CSV);
+  assert(n && buf[n - 1] == '\n');
+  assert(!gfn_format_header(buf, sizeof(buf), GFN_FORMAT_JSON));
+
+  expect(GFN_FORMAT_CSV, &rec,
+         "ok,4242,4660,7204917812,139637976732212,thp,1,Normal,,,,,\n");
+  rec.err = GFN_RECORD_ERR_HVA;
+  rec.error = -14;
+  rec.flags = GFN_RECORD_HAS_TAG;
+  rec.tag = 9;
+  expect(GFN_FORMAT_CSV, &rec, "err,4242,4660,,,,,,hva,-14,9,,\n");
+
+  rec = result();
+  rec.type = GFN_RECORD_INVAL;
+  rec.npages = 512;
+  rec.cookie = 7;
+  expect(GFN_FORMAT_CSV, &rec, "inval,4242,4660,,,,,,,,,512,7\n");
+}
+
+static void test_json(void) {
+  struct gfn_record rec = result();
+
+  rec.flags = GFN_RECORD_HAS_TAG;
+  rec.tag = 1;
+  expect(GFN_FORMAT_JSON, &rec,
+         "{\"type\":\"ok\",\"pid\":4242,\"gpa\":4660,\"phys\":7204917812,"
+         "\"hva\":139637976732212,\"kind\":\"thp\",\"node\":1,"
+         "\"zone\":\"Normal\",\"tag\":1}\n");
+  rec.flags = 0;
+  rec.err = GFN_RECORD_ERR_NO_VMS;
+  rec.error = -19;
+  expect(GFN_FORMAT_JSON, &rec,
+         "{\"type\":\"err\",\"pid\":4242,\"gpa\":4660,\"error\":\"no_vms\","
+         "\"errno\":-19}\n");
+
+  rec = result();
+  rec.type = GFN_RECORD_OVERFLOW;
+  rec.cookie = 3;
+  expect(GFN_FORMAT_JSON, &rec, "{\"type\":\"overflow\",\"lost\":3}\n");
+}
+
+static void test_binary(void) {
+  struct gfn_record rec = result(), out;
+  char buf[256];
+
+  assert(gfn_format_record(buf, sizeof(buf), GFN_FORMAT_BINARY, &rec,
+                           "Normal") == sizeof(rec));
+  memcpy(&out, buf, sizeof(out));
+  assert(!memcmp(&out, &rec, sizeof(rec)));
+  assert(!gfn_format_record(buf, sizeof(rec) - 1, GFN_FORMAT_BINARY, &rec,
+                            "Normal"));
+}
+
+/* Output never runs past the buffer, however small. */
+static void test_truncate(void) {
+  struct gfn_record rec = result();
+  char buf[16];
+  size_t n;
+
+  memset(buf, 'x', sizeof(buf));
+  n = gfn_format_record(buf, 8, GFN_FORMAT_JSON, &rec, "Normal");
+  assert(n < 8 && buf[n] == '\0' && buf[8] == 'x');
+}
+
+int main(void) {
+  test_text();
+  test_csv();
+  test_json();
+  test_binary();
+  test_truncate();
+
+  printf("all format tests passed\n");
+  return 0;
+}
@@ -6,53 +6,280 @@
 
 #include "../gfn_parse.h"
 
+#define MAX_LINES 16
+
+/* Every line the stream hands over, with its GFNs copied out. */
+struct collect {
+  struct gfn_line lines[MAX_LINES];
+  unsigned long gfns[MAX_LINES][GFN_LINE_MAX];
+  size_t nr;
+};
+
+static int collect_line(void *arg, const struct gfn_line *line) {
+  struct collect *c = arg;
+
+  assert(c->nr < MAX_LINES);
+  memcpy(c->gfns[c->nr], line->gfns, line->nr * sizeof(*line->gfns));
+  c->lines[c->nr] = *line;
+  c->lines[c->nr].gfns = c->gfns[c->nr];
+  c->nr++;
+  return 0;
+}
+
+/* Feed input in pieces of step bytes (0: all at once). */
+static void feed(struct collect *c, const char *input, size_t step) {
+  static struct gfn_stream s;
+  size_t len = strlen(input), off = 0;
+
+  memset(c, 0, sizeof(*c));
+  gfn_stream_init(&s);
+  if (!step)
+    step = len ? len : 1;
+  while (off < len) {
+    size_t n = len - off < step ? len - off : step;
+
+    size_t used;
+
+    assert(!gfn_stream_feed(&s, input + off, n, &used, collect_line, c));
+    assert(used == n);
+    off += n;
+  }
+  gfn_stream_destroy(&s);
+}
+
+static const struct gfn_line *one_line(struct collect *c, const char *input) {
+  feed(c, input, 0);
+  if (c->nr != 1) {
+    fprintf(stderr, "expected one line for '%s' but got %zu\n", input, c->nr);
+    assert(c->nr == 1);
+  }
+  return &c->lines[0];
+}
+
 static void expect_success(const char *input, unsigned long gfn,
                            bool expect_pid, unsigned long pid) {
-  struct gfn_request req;
-  char buf[128];
-
-  strncpy(buf, input, sizeof(buf) - 1);
-  buf[sizeof(buf) - 1] = '\0';
+  static struct collect c;
+  const struct gfn_line *line = one_line(&c, input);
 
-  int rc = gfn_parse_request(buf, &req);
-  if (rc) {
-    fprintf(stderr, "expected success for '%s' but got %d\n", input, rc);
-    assert(!rc);
+  if (line->error) {
+    fprintf(stderr, "expected success for '%s' but got %d\n", input,
+            line->error);
+    assert(!line->error);
   }
 
-  assert(req.raw_gfn == gfn);
-  assert(req.has_pid == expect_pid);
+  assert(line->nr == 1);
+  assert(line->gfns[0] == gfn);
+  assert(line->has_pid == expect_pid);
   if (expect_pid)
-    assert(req.vm_pid == pid);
+    assert(line->vm_pid == pid);
 }
 
-static void expect_failure(const char *input) {
-  struct gfn_request req;
-  char buf[128];
+static void expect_tag(const char *input, unsigned long gfn,
+                       unsigned long tag) {
+  static struct collect c;
+  const struct gfn_line *line = one_line(&c, input);
+
+  assert(!line->error);
+  assert(line->nr == 1);
+  assert(line->gfns[0] == gfn);
+  assert(line->has_tag);
+  assert(line->tag == tag);
+}
 
-  strncpy(buf, input, sizeof(buf) - 1);
-  buf[sizeof(buf) - 1] = '\0';
+static void expect_failure(const char *input) {
+  static struct collect c;
+  const struct gfn_line *line = one_line(&c, input);
 
-  int rc = gfn_parse_request(buf, &req);
-  if (!rc) {
+  if (!line->error) {
     fprintf(stderr, "expected failure for '%s' but parser succeeded\n", input);
-    assert(rc);
+    assert(line->error);
   }
+  assert(line->nr == 0);
+}
+
+static void expect_nothing(const char *input) {
+  static struct collect c;
+
+  feed(&c, input, 0);
+  assert(c.nr == 0);
+}
+
+/* Lists, keys anywhere on the line, and several lines in one buffer. */
+static void test_lists(void) {
+  static struct collect c;
+  const struct gfn_line *line;
+
+  line = one_line(&c, "0x1111 0x2222 0x3333 0x4444\n");
+  assert(!line->error && !line->has_pid && line->nr == 4);
+  assert(line->gfns[0] == 0x1111 && line->gfns[3] == 0x4444);
+
+  line = one_line(&c, "0x1 0x2 pid=42 tag=3\n");
+  assert(!line->error && line->nr == 2);
+  assert(line->has_pid && line->vm_pid == 42 && line->tag == 3);
+
+  line = one_line(&c, "pid=0 0x1 0x2\n");
+  assert(!line->error && line->nr == 2 && !line->has_pid);
+
+  feed(&c, "0x1000 42\n\n0x2000\nbad\n0x3000 0x4000 0x5000\n", 0);
+  assert(c.nr == 4);
+  assert(c.lines[0].nr == 1 && c.lines[0].vm_pid == 42);
+  assert(c.lines[1].nr == 1 && c.lines[1].gfns[0] == 0x2000);
+  assert(c.lines[2].error == -EINVAL);
+  assert(c.lines[3].nr == 3 && !c.lines[3].has_pid);
+}
+
+/* The same input cut at every size must give the same lines. */
+static void test_split(void) {
+  static struct collect whole, cut;
+  const char *input = "0x1abc 0x2def 017 pid=99 tag=0x7\n0x10 5\n";
+  size_t step, i;
+
+  feed(&whole, input, 0);
+  assert(whole.nr == 2);
+  assert(whole.lines[0].nr == 3 && whole.gfns[0][2] == 017);
+  for (step = 1; step < strlen(input); step++) {
+    feed(&cut, input, step);
+    assert(cut.nr == whole.nr);
+    for (i = 0; i < cut.nr; i++) {
+      assert(cut.lines[i].nr == whole.lines[i].nr);
+      assert(cut.lines[i].vm_pid == whole.lines[i].vm_pid);
+      assert(cut.lines[i].tag == whole.lines[i].tag);
+      assert(!memcmp(cut.gfns[i], whole.gfns[i],
+                     cut.lines[i].nr * sizeof(unsigned long)));
+    }
+  }
+
+  /* Nothing is handed over until the newline. */
+  feed(&cut, "0x1234", 1);
+  assert(cut.nr == 0);
+}
+
+/* A line longer than GFN_LINE_MAX arrives in parts. */
+static void test_long_line(void) {
+  static char input[(GFN_LINE_MAX + 10) * 8 + 16];
+  static struct collect c;
+  size_t i, off = 0;
+
+  off += sprintf(input + off, "pid=7");
+  for (i = 0; i < GFN_LINE_MAX + 10; i++)
+    off += sprintf(input + off, " 0x%zx", i);
+  sprintf(input + off, "\n");
+
+  feed(&c, input, 1000);
+  assert(c.nr == 2);
+  assert(c.lines[0].nr == GFN_LINE_MAX && c.lines[0].vm_pid == 7);
+  assert(c.lines[1].nr == 10 && c.lines[1].gfns[9] == GFN_LINE_MAX + 9);
+}
+
+/* Refuses every other line, like a full reply queue, until fed again. */
+static int refuse_line(void *arg, const struct gfn_line *line) {
+  static bool refused;
+
+  refused = !refused;
+  if (refused)
+    return -EAGAIN;
+  return collect_line(arg, line);
+}
+
+/* A refused line is kept and handed over once when the rest is fed again. */
+static void test_retry(void) {
+  static char input[(GFN_LINE_MAX + 10) * 8 + 64];
+  static struct gfn_stream s;
+  static struct collect c;
+  size_t len, off = 0, used, i;
+  int rc;
+
+  off += sprintf(input + off, "0x1 pid=3\n0x2 0x3 0x4 tag=4\npid=5");
+  for (i = 0; i < GFN_LINE_MAX + 10; i++)
+    off += sprintf(input + off, " 0x%zx", i);
+  sprintf(input + off, "\n0x9\n");
+  len = strlen(input);
+
+  memset(&c, 0, sizeof(c));
+  gfn_stream_init(&s);
+  for (off = 0; off < len; off += used) {
+    rc = gfn_stream_feed(&s, input + off, len - off, &used, refuse_line, &c);
+    assert(!rc || rc == -EAGAIN);
+    assert(off + used <= len);
+  }
+  gfn_stream_destroy(&s);
+
+  assert(c.nr == 5);
+  assert(c.lines[0].nr == 1 && c.lines[0].vm_pid == 3);
+  assert(c.lines[1].nr == 3 && c.lines[1].tag == 4 && !c.lines[1].has_pid);
+  assert(c.lines[2].nr == GFN_LINE_MAX && c.lines[2].vm_pid == 5);
+  assert(c.gfns[2][GFN_LINE_MAX - 1] == GFN_LINE_MAX - 1);
+  assert(c.lines[3].nr == 10 && c.lines[3].gfns[0] == GFN_LINE_MAX);
+  assert(c.lines[4].nr == 1 && c.lines[4].gfns[0] == 0x9);
+}
+
+/* Any two numbers without pid= are "gfn pid", whatever their format. */
+static void test_legacy(void) {
+  static const char *const pairs[] = {
+      "0x1000 0x2000\n", "4096 8192\n", "0x1000 042\n", "010 5\n",
+  };
+  static struct collect c;
+  const struct gfn_line *line;
+  size_t i;
+
+  for (i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+    line = one_line(&c, pairs[i]);
+    assert(!line->error && line->nr == 1 && line->has_pid);
+  }
+
+  line = one_line(&c, "0x1000 0x2000\n");
+  assert(line->gfns[0] == 0x1000 && line->vm_pid == 0x2000);
+
+  line = one_line(&c, "0x1000 0x2000 pid=0\n");
+  assert(line->nr == 2 && !line->has_pid);
+
+  /* Incompatible: this used to be GFN 0x1 on VM 2, the 0x3 ignored. */
+  line = one_line(&c, "0x1 0x2 0x3\n");
+  assert(!line->error && line->nr == 3 && !line->has_pid);
+}
+
+static void test_numbers(void) {
+  expect_success("0XfF\n", 0xff, false, 0);
+  expect_success("0755\n", 0755, false, 0);
+  expect_success("0\n", 0, false, 0);
+  expect_success("0xffffffffffffffff\n", 0xffffffffffffffffUL, false, 0);
+
+  expect_failure("0x10000000000000000\n");
+  expect_failure("0x\n");
+  expect_failure("08\n");
+  expect_failure("12a\n");
+  expect_failure("0x000000000000000000000000000000001\n");
 }
 
 int main(void) {
-  expect_success("0x1000 42", 0x1000, true, 42);
-  expect_success("4096", 4096, false, 0);
+  expect_success("0x1000 42\n", 0x1000, true, 42);
+  expect_success("4096\n", 4096, false, 0);
   expect_success("   0x20   \n", 0x20, false, 0);
-  expect_success("0  123", 0, true, 123);
-  expect_success("0x1 0x2 0x3", 0x1, true, 0x2);
+  expect_success("0  123\n", 0, true, 123);
+  expect_success("0x1000 42 tag=7\n", 0x1000, true, 42);
+  expect_success("0x1000 pid=42\n", 0x1000, true, 42);
+
+  expect_tag("0x1000 tag=7\n", 0x1000, 7);
+  expect_tag("tag=0x10 0x2000 42\n", 0x2000, 0x10);
+  expect_tag("0x3000 42 tag=9\r\n", 0x3000, 9);
 
-  expect_failure("");
-  expect_failure("    \n");
-  expect_failure("xyz");
-  expect_failure("0x20 pid");
+  expect_nothing("");
+  expect_nothing("    \n");
+
+  expect_failure("xyz\n");
+  expect_failure("0x20 pid\n");
+  expect_failure("0x20 tag=\n");
+  expect_failure("0x20 tag=abc\n");
+  expect_failure("0x20 pid=x\n");
+  expect_failure("tag=5\n");
+
+  test_lists();
+  test_split();
+  test_long_line();
+  test_retry();
+  test_legacy();
+  test_numbers();
 
   printf("all parser tests passed\n");
   return 0;
 }
-
@@ -0,0 +1,85 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "../gfn_rmap_table.h"
+
+static void add(struct gfn_rmap_table *t, __u64 pfn, __u64 gfn,
+                __u64 npages) {
+  assert(!gfn_rmap_table_add(t, pfn, gfn, npages, 1));
+}
+
+/* The gfn pfn maps to, or -1 when the table has no extent for it. */
+static long long lookup(const struct gfn_rmap_table *t, __u64 pfn) {
+  const struct gfn_rmap_ext *e = gfn_rmap_table_find(t, pfn);
+
+  if (!e)
+    return -1;
+  assert(pfn >= e->pfn && pfn < e->pfn + e->npages);
+  return e->gfn + (pfn - e->pfn);
+}
+
+/* Disjoint extents, the gaps between them, and both ends of the table. */
+static void test_disjoint(void) {
+  struct gfn_rmap_table t = {0};
+
+  add(&t, 0x3000, 0x30, 16);
+  add(&t, 0x1000, 0x10, 16);
+  add(&t, 0x2000, 0x20, 1);
+  gfn_rmap_table_sort(&t);
+
+  assert(lookup(&t, 0xfff) == -1);
+  assert(lookup(&t, 0x1000) == 0x10);
+  assert(lookup(&t, 0x100f) == 0x1f);
+  assert(lookup(&t, 0x1010) == -1);
+  assert(lookup(&t, 0x2000) == 0x20);
+  assert(lookup(&t, 0x2001) == -1);
+  assert(lookup(&t, 0x300f) == 0x3f);
+  assert(lookup(&t, 0x3010) == -1);
+  gfn_rmap_table_free(&t);
+}
+
+/*
+ * A long extent (a 1G page) with short aliases starting inside it, as
+ * when the same RAM is mapped by several memslots: PFNs past the aliases
+ * still belong to the long extent.
+ */
+static void test_contained(void) {
+  struct gfn_rmap_table t = {0};
+
+  add(&t, 0x40000, 0x100000, 0x40000);
+  add(&t, 0x400a0, 0xa0, 0x20);
+  add(&t, 0x400c0, 0xc0, 0x20);
+  gfn_rmap_table_sort(&t);
+
+  assert(lookup(&t, 0x40000) == 0x100000);
+  assert(lookup(&t, 0x400b0) == 0xb0);
+  assert(lookup(&t, 0x400df) == 0xdf);
+  assert(lookup(&t, 0x400e0) == 0x1000e0);
+  assert(lookup(&t, 0x7ffff) == 0x13ffff);
+  assert(lookup(&t, 0x80000) == -1);
+  gfn_rmap_table_free(&t);
+}
+
+/* Contiguous runs added in pieces join up into one extent. */
+static void test_join(void) {
+  struct gfn_rmap_table t = {0};
+
+  add(&t, 0x5000, 0x50, 8);
+  add(&t, 0x5008, 0x58, 8);
+  add(&t, 0x6000, 0x60, 8);
+  gfn_rmap_table_sort(&t);
+
+  assert(t.nr == 2);
+  assert(t.ext[0].npages == 16);
+  assert(lookup(&t, 0x500f) == 0x5f);
+  gfn_rmap_table_free(&t);
+}
+
+int main(void) {
+  test_disjoint();
+  test_contained();
+  test_join();
+
+  printf("all rmap table tests passed\n");
+  return 0;
+}